@@ -0,0 +1,205 @@
+// Microbenchmarks of the profiler's own cost
+// Output is CSV (benchmark,param,iterations,ns_per_op), to stdout and optionally a file
+//   stperf-bench [output.csv] [--quick]
+#include "stperf.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static std::uint64_t NowNanos()
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Best of a few runs, the minimum is the least noisy estimate of the hot path
+static double MeasureNanos(int repeats, const std::function<void()>& run)
+{
+    std::uint64_t best = UINT64_MAX;
+    for(int i = 0; i < repeats; i++)
+    {
+        cag::PerfTimer::ResetCounters();
+        const std::uint64_t start = NowNanos();
+        run();
+        best = std::min(best, NowNanos() - start);
+    }
+    return static_cast<double>(best);
+}
+
+struct BenchOutput
+{
+    std::ostringstream _csv;
+
+    void add(const std::string& name, std::uint64_t param, std::uint64_t iterations, double ns_per_op)
+    {
+        _csv << name << ',' << param << ',' << iterations << ',' << ns_per_op << '\n';
+        std::cerr << name << " [" << param << "] " << ns_per_op << " ns/op" << std::endl;
+    }
+};
+
+static void BenchEmptyScope(BenchOutput& out, std::uint64_t iterations)
+{
+    const double nanos = MeasureNanos(3, [iterations]() {
+        for(std::uint64_t i = 0; i < iterations; i++)
+        {
+            ST_PROF_NAMED("bench_empty");
+        }
+    });
+    out.add("cpp_empty_scope", 0, iterations, nanos / iterations);
+}
+
+static void NestedScope(int depth)
+{
+    ST_PROF_NAMED("bench_nested");
+    if(depth > 1) NestedScope(depth - 1);
+}
+
+static void BenchNestedScopes(BenchOutput& out, std::uint64_t iterations)
+{
+    for(int depth = 1; depth <= 64; depth *= 2)
+    {
+        const std::uint64_t outer = std::max<std::uint64_t>(1, iterations / depth);
+        const double nanos = MeasureNanos(3, [outer, depth]() {
+            for(std::uint64_t i = 0; i < outer; i++) NestedScope(depth);
+        });
+        out.add("cpp_nested_scope", depth, outer * depth, nanos / (outer * depth));
+    }
+}
+
+static void BenchThreads(BenchOutput& out, std::uint64_t iterations)
+{
+    const unsigned max_threads = std::max(4U, std::thread::hardware_concurrency());
+    for(unsigned count = 1; count <= max_threads; count *= 2)
+    {
+        // Per scope cost seen by each thread, all of them start together
+        const double nanos = MeasureNanos(3, [iterations, count]() {
+            std::atomic<unsigned> ready(0);
+            std::vector<std::thread> threads;
+            for(unsigned t = 0; t < count; t++)
+            {
+                threads.emplace_back([iterations, count, &ready]() {
+                    ready++;
+                    while(ready.load() < count) std::this_thread::yield();
+                    for(std::uint64_t i = 0; i < iterations; i++)
+                    {
+                        ST_PROF_NAMED("bench_threads");
+                    }
+                });
+            }
+            for(auto& thread : threads) thread.join();
+        });
+        out.add("cpp_threads_scope", count, iterations, nanos / iterations);
+    }
+}
+
+static void BenchCApi(BenchOutput& out, std::uint64_t iterations)
+{
+    const double named = MeasureNanos(3, [iterations]() {
+        for(std::uint64_t i = 0; i < iterations; i++)
+        {
+            uint64_t handle = stperf_StartProf("bench_c_named", __LINE__, NULL);
+            stperf_StopProf(handle);
+        }
+    });
+    out.add("c_named_scope", 0, iterations, named / iterations);
+
+    const uint32_t site = stperf_RegisterSite("bench_c_handle", __LINE__, NULL);
+    const double handle = MeasureNanos(3, [iterations, site]() {
+        for(std::uint64_t i = 0; i < iterations; i++)
+        {
+            stperf_Enter(site);
+            stperf_Exit(site);
+        }
+    });
+    out.add("c_handle_scope", 0, iterations, handle / iterations);
+}
+
+// Fanout^1 + ... + fanout^depth nodes out of only fanout distinct sites
+static void BuildTree(const std::vector<uint32_t>& sites, int depth)
+{
+    for(const uint32_t site : sites)
+    {
+        stperf_Enter(site);
+        if(depth > 1) BuildTree(sites, depth - 1);
+        stperf_Exit(site);
+    }
+}
+
+static void BenchReports(BenchOutput& out, bool quick)
+{
+    const int max_fanout = quick ? 32 : 100;
+    std::vector<uint32_t> sites;
+    for(int i = 0; i < max_fanout; i++) sites.push_back(stperf_RegisterSite(("bench_tree_" + std::to_string(i)).c_str(), __LINE__, NULL));
+
+    for(const int fanout : { 10, 32, 100 })
+    {
+        if(fanout > max_fanout) break;
+        const std::vector<uint32_t> level(sites.begin(), sites.begin() + fanout);
+        const std::uint64_t nodes = fanout + fanout * fanout + static_cast<std::uint64_t>(fanout) * fanout * fanout;
+
+        cag::PerfTimer::ResetCounters();
+        BuildTree(level, 3);
+
+        // Snapshots leave the tree untouched, no reset in between
+        const int repeats = quick ? 1 : 3;
+        auto measure = [repeats](const std::function<void()>& run) {
+            std::uint64_t best = UINT64_MAX;
+            for(int i = 0; i < repeats; i++)
+            {
+                const std::uint64_t start = NowNanos();
+                run();
+                best = std::min(best, NowNanos() - start);
+            }
+            return static_cast<double>(best);
+        };
+
+        out.add("report_get_call_tree", nodes, 1, measure([]() { (void)cag::PerfTimer::GetCallTree(); }));
+        const auto tree = cag::PerfTimer::GetCallTree();
+        // Repeats of the same tree are served from the cached previous output
+        out.add("report_call_tree_string", nodes, 1, measure([&tree]() { (void)cag::PerfTimer::GetCallTreeString(tree); }));
+        out.add("report_call_tree_dot", nodes, 1, measure([&tree]() { (void)cag::PerfTimer::GetCallTreeDot(tree); }));
+        out.add("report_c_flat_tree", nodes, 1, measure([]() { stperf_FreeFlatCallTree(stperf_GetFlatCallTree()); }));
+        out.add("report_c_call_tree", nodes, 1, measure([]() { stperf_FreeCallTree(stperf_GetCallTree()); }));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = nullptr;
+    bool quick = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--quick") == 0) quick = true;
+        else path = argv[i];
+    }
+
+    const std::uint64_t iterations = quick ? 100000 : 2000000;
+    BenchOutput out;
+    out._csv << "benchmark,param,iterations,ns_per_op\n";
+
+    BenchEmptyScope(out, iterations);
+    BenchNestedScopes(out, iterations);
+    BenchThreads(out, iterations / 4);
+    BenchCApi(out, iterations);
+    BenchReports(out, quick);
+    cag::PerfTimer::StopCounters();
+
+    std::cout << out._csv.str();
+    if(path != nullptr)
+    {
+        std::ofstream file(path, std::ios::out | std::ios::trunc);
+        file << out._csv.str();
+        if(!file) return 1;
+    }
+    return 0;
+}
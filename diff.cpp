@@ -0,0 +1,50 @@
+// Compares two binary dumps (see WriteCallTreeDump), biggest regressions first
+//   stperf-diff before.dump after.dump [--dot | --folded] [output]
+// Text by default, --dot colours nodes by change and --folded feeds differential flamegraphs
+#include "stperf.h"
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static int Usage()
+{
+    std::cerr << "usage: stperf-diff before.dump after.dump [--dot | --folded] [output]" << std::endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const char*> paths;
+    int format = STPERF_DIFF_TEXT;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--dot") == 0) format = STPERF_DIFF_DOT;
+        else if(strcmp(argv[i], "--folded") == 0) format = STPERF_DIFF_FOLDED;
+        else if(argv[i][0] == '-' && argv[i][1] == '-') return Usage();
+        else paths.push_back(argv[i]);
+    }
+    if(paths.size() < 2 || paths.size() > 3) return Usage();
+
+    const char* diff = stperf_GetCallTreeDiff(paths[0], paths[1], format);
+    if(diff == nullptr)
+    {
+        std::cerr << "stperf-diff: cannot read " << paths[0] << " or " << paths[1] << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    if(paths.size() == 3)
+    {
+        std::ofstream file(paths[2], std::ios::out | std::ios::trunc);
+        file << diff;
+        ok = static_cast<bool>(file);
+    }
+    else
+    {
+        std::cout << diff;
+    }
+    stperf_FreeCallTreeString(diff);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+// Built with ST_PROF_DISABLED, every macro must compile to nothing without warnings
+// Exits with 1 if any of them still recorded into the profiler
+#ifndef ST_PROF_DISABLED
+#define ST_PROF_DISABLED
+#endif
+#include "stperf.h"
+#include <cstdint>
+#include <iostream>
+
+// Parameters and locals only used by the macros must not warn as unused
+static void Profiled(const char* name, std::uint32_t rate, std::uint64_t bytes, cag::PerfTask& task)
+{
+    ST_PROF;
+    ST_PROF_NAMED(name);
+    ST_PROF_SAMPLED(name, rate);
+    ST_PROF_TASK(task);
+    ST_PROF_TASK_NAMED(task, name);
+    const std::uint64_t items = bytes / 4;
+    ST_COUNT("bytes", bytes);
+    ST_COUNT(name, items);
+}
+
+int main()
+{
+    cag::PerfTask task;
+    for(int i = 0; i < 10; i++) Profiled("disabled_scope", 4, 1024, task);
+    if(true) ST_COUNT("dangling_else", 1);
+    else ST_COUNT("dangling_else", 2);
+
+    if(!cag::PerfTimer::GetCallTree().empty() || !cag::PerfTimer::GetTaskCallTree().empty())
+    {
+        std::cerr << "stperf-disabled: disabled macros still recorded scopes" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -2,12 +2,21 @@
 // This code is licensed under MIT license (see LICENSE for details)
 
 #include "stperf.h"
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -15,11 +24,46 @@
 #include <string>
 #include <sys/types.h>
 #include <thread>
+#include <time.h>
 #include <type_traits>
-#include <numeric>
 #include <type_traits>
 #include <vector>
 
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define ST_HW_CLOCK_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+#define ST_HW_CLOCK_ARM64
+#endif
+
+#if defined(__linux__)
+#define ST_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 // TODO : (César) Thread parent (init) is not known with this approach
 
 // =================================
@@ -32,440 +76,3764 @@ decltype(cag::PerfNode::_time_suffix) cag::PerfNode::_time_suffix = {
     { Granularity::NS, "ns" }
 };
 
-void cag::PerfNode::print(std::stringstream& ss) const
+// Growable output of the report formatters, it keeps its capacity from one report to the next
+struct TextBuffer
 {
-    // Indent this node from parent count
-    for(int i = 0; i < _indent; i++) ss << '\t';
-    
-    // Print stats
-    ss << "-> [" << _name;
-    if(_hits > 0) ss << " | x" << _hits;
-    ss << "] Execution time : ";
-    ss << _value << _time_suffix.at(_granularity) << " (";
-    const auto default_precision = std::cout.precision();
-    ss << std::setw(3) << std::setprecision(4) << 100 * _pct << std::setprecision(default_precision) << "%).";
-    ss << std::endl;
+    std::string _text;
+
+    TextBuffer& operator<<(const char* s) { _text += s; return *this; }
+    TextBuffer& operator<<(const std::string& s) { _text += s; return *this; }
+    TextBuffer& operator<<(char c) { _text += c; return *this; }
+    TextBuffer& operator<<(double value) { return number(value, 6); }
+
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, TextBuffer&>::type operator<<(T value)
+    {
+        appendUnsigned(value);
+        return *this;
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, TextBuffer&>::type operator<<(T value)
+    {
+        if(value < 0) _text += '-';
+        appendUnsigned(value < 0 ? 0 - static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value));
+        return *this;
+    }
+
+    // Same text as an ostream with setw(width) and setprecision(precision)
+    TextBuffer& number(double value, int precision, int width = 0)
+    {
+        char digits[32];
+        const int size = snprintf(digits, sizeof(digits), "%*.*g", width, precision, value);
+        if(size > 0) _text.append(digits, std::min(static_cast<std::size_t>(size), sizeof(digits) - 1));
+        return *this;
+    }
+
+    void appendUnsigned(std::uint64_t value)
+    {
+        char digits[20];
+        char* begin = digits + sizeof(digits);
+        do
+        {
+            *--begin = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while(value != 0);
+        _text.append(begin, digits + sizeof(digits));
+    }
+};
+
+// Same as PerfNode::_time_suffix, without the map lookup
+static const char* TimeSuffix(cag::PerfNode::Granularity granularity)
+{
+    switch(granularity)
+    {
+        case cag::PerfNode::Granularity::S:  return "s";
+        case cag::PerfNode::Granularity::MS: return "ms";
+        case cag::PerfNode::Granularity::US: return "us";
+        default:                             return "ns";
+    }
 }
 
-// =================================
-// PerfTimer
-// =================================
-decltype(cag::PerfTimer::_timer_stack) cag::PerfTimer::_timer_stack;
-decltype(cag::PerfTimer::_scope_stack) cag::PerfTimer::_scope_stack;
-decltype(cag::PerfTimer::_parents) cag::PerfTimer::_parents;
-decltype(cag::PerfTimer::_scope_stack_guard) cag::PerfTimer::_scope_stack_guard;
+static void PrintNanos(TextBuffer& ss, std::uint64_t nanos)
+{
+    const auto granularity = cag::FindTimeGranularity(nanos);
+    ss << cag::NanosToValue(granularity, nanos) << TimeSuffix(granularity);
+}
 
-cag::PerfTimer::PerfTimer(const std::string& name,
-                              int line,
-                              const std::string& suffix) : 
-    _scope_name(name + suffix), _line(line)
-{  }
+static void PrintSelfTime(TextBuffer& ss, std::uint64_t self_nanos, float self_pct)
+{
+    ss << " Self time : ";
+    PrintNanos(ss, self_nanos);
+    ss << " (";
+    ss.number(100 * self_pct, 4, 3) << "%).";
+}
 
-void cag::PerfTimer::start()
+static void PrintLatency(TextBuffer& ss, const cag::PerfLatency& latency)
 {
-    _tp = std::chrono::high_resolution_clock::now();
-    addLeaf();
+    ss << " [min ";  PrintNanos(ss, latency._min_nanos);
+    ss << " | mean "; PrintNanos(ss, latency._mean_nanos);
+    ss << " | p50 ";  PrintNanos(ss, latency._p50_nanos);
+    ss << " | p99 ";  PrintNanos(ss, latency._p99_nanos);
+    ss << " | p99.9 "; PrintNanos(ss, latency._p999_nanos);
+    ss << " | max ";  PrintNanos(ss, latency._max_nanos);
+    ss << "]";
 }
 
-void cag::PerfTimer::stop() const
+static void PrintThreadSpread(TextBuffer& ss, std::uint64_t threads, std::uint64_t min, std::uint64_t max, float imbalance)
 {
-    // Stack is invalid (Maybe a reset call was issued during this prof)
-    if(_scope_stack.empty()) return;
-    auto thread_stack_it = _scope_stack.find(std::this_thread::get_id());
-    
-    // Stack is valid but it was not initialized on this thread
-    if(thread_stack_it == _scope_stack.end()) return;
-    auto& thread_stack = thread_stack_it->second;
+    ss << " {" << threads << " threads | min ";
+    PrintNanos(ss, min);
+    ss << " | max ";
+    PrintNanos(ss, max);
+    ss << " | imbalance ";
+    ss.number(100 * imbalance, 4) << "%}";
+}
 
-    const std::uint64_t ellapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
-        std::chrono::high_resolution_clock::now() - _tp
-    ).count();
+static void PrintTaskTime(TextBuffer& ss, std::uint64_t nanos, std::uint64_t suspended_nanos)
+{
+    ss << " Active : ";
+    PrintNanos(ss, nanos - std::min(nanos, suspended_nanos));
+    ss << " | Suspended : ";
+    PrintNanos(ss, suspended_nanos);
+    ss << ".";
+}
 
-    PerfNode* const top_node = thread_stack.top();
-    
-    // Find time and data
-    const auto granularity = FindTimeGranularity(ellapsed);
-    top_node->_granularity = granularity;
-    top_node->_value = NanosToValue(granularity, ellapsed);
-    top_node->_nanos = ellapsed;
-    top_node->_name = _scope_name;
-    top_node->_indent = static_cast<int>(thread_stack.size()) - 1;
-    
-    delLeaf();
+static void PrintCpuTime(TextBuffer& ss, std::uint64_t cpu_nanos, std::uint64_t off_cpu_nanos)
+{
+    ss << " On CPU : ";
+    PrintNanos(ss, cpu_nanos);
+    ss << " | Off CPU : ";
+    PrintNanos(ss, off_cpu_nanos);
+    ss << ".";
 }
 
-void cag::PerfTimer::addLeaf() const
+static void PrintPlacement(TextBuffer& ss, const std::uint64_t* hits, const std::uint64_t* nanos, std::size_t nodes)
 {
-    if(_scope_stack.find(std::this_thread::get_id()) == _scope_stack.end())
+    bool first = true;
+    for(std::size_t i = 0; i < nodes; i++)
     {
-        std::lock_guard<std::mutex> lock(_scope_stack_guard);
-        _timer_stack.emplace(std::this_thread::get_id(), std::stack<std::weak_ptr<const PerfTimer>>());
-        _scope_stack.emplace(std::this_thread::get_id(), std::stack<PerfNode*>());
-        _parents.emplace(std::this_thread::get_id(), std::vector<PerfNode>());
+        if(hits[i] == 0) continue;
+        ss << (first ? " NUMA : node " : " | node ") << i << " x" << hits[i] << " ";
+        PrintNanos(ss, nanos[i]);
+        first = false;
     }
-    auto& timer_stack = _timer_stack.at(std::this_thread::get_id());
-    auto& thread_stack = _scope_stack.at(std::this_thread::get_id());
-    auto& thread_parents = _parents.at(std::this_thread::get_id());
+    if(!first) ss << ".";
+}
 
-    if(thread_stack.empty())
+static void PrintCounters(TextBuffer& ss, const cag::PerfCounters& counters)
+{
+    // Misses per thousand instructions
+    const double kilo_instructions = static_cast<double>(counters._instructions) / 1000.0;
+    ss << " <IPC ";
+    ss.number(counters._cycles > 0 ? static_cast<double>(counters._instructions) / static_cast<double>(counters._cycles) : 0.0, 3);
+    ss << " | LLC misses " << counters._cache_misses;
+    if(kilo_instructions > 0.0)
     {
-        thread_parents.emplace_back();
-        thread_stack.push(&thread_parents.back());
+        ss << " (";
+        ss.number(static_cast<double>(counters._cache_misses) / kilo_instructions, 3) << " MPKI)";
     }
-    else
+    ss << " | branch misses " << counters._branch_misses;
+    if(kilo_instructions > 0.0)
     {
-        PerfNode* const top = thread_stack.top();
-        top->_children.emplace_back();
-        thread_stack.push(&top->_children.back());
+        ss << " (";
+        ss.number(static_cast<double>(counters._branch_misses) / kilo_instructions, 3) << " MPKI)";
     }
+    ss << ">";
+}
 
-    timer_stack.push(shared_from_this());
+static void PrintCount(TextBuffer& ss, const char* name, std::uint64_t value, double rate)
+{
+    ss << " (" << name << " : " << value;
+    if(rate > 0.0)
+    {
+        ss << " | ";
+        ss.number(rate, 4) << "/s";
+    }
+    ss << ")";
 }
 
-void cag::PerfTimer::delLeaf() const
+const std::string& cag::PerfNode::name() const
 {
-    _timer_stack.at(std::this_thread::get_id()).pop();
-    _scope_stack.at(std::this_thread::get_id()).pop();
+    return PerfTimer::GetSite(_id)._name;
 }
 
-cag::PerfNode::Granularity cag::FindTimeGranularity(std::uint64_t t)
+const std::string& cag::PerfCount::name() const
 {
-    if(t / 0x3B9ACA00ULL > 0) return PerfNode::Granularity::S;
-    if(t / 0xF4240ULL > 0)    return PerfNode::Granularity::MS;
-    if(t / 0x3E8ULL > 0)      return PerfNode::Granularity::US;
-    return PerfNode::Granularity::NS;
+    return PerfTimer::GetSite(_id)._name;
 }
 
+// One line of the call tree, without the indent
+static void PrintNode(TextBuffer& ss, const cag::PerfNode& node)
+{
+    ss << "-> [" << node.name();
+    if(node._hits > 0) ss << " | x" << node._hits;
+    if(node._raw_hits != node._hits) ss << " (sampled x" << node._raw_hits << ")";
+    ss << "] Execution time : ";
+    ss << node._value << TimeSuffix(node._granularity) << " (";
+    ss.number(100 * node._pct, 4, 3) << "%).";
+    if(!node._children.empty()) PrintSelfTime(ss, node._self_nanos, node._self_pct);
+    if(node._latency._samples > 0) PrintLatency(ss, node._latency);
+    if(node._threads > 1) PrintThreadSpread(ss, node._threads, node._min_thread_nanos, node._max_thread_nanos, node._imbalance);
+    if(node._cpu_nanos > 0) PrintCpuTime(ss, node._cpu_nanos, node._off_cpu_nanos);
+    if(node._suspended_nanos > 0) PrintTaskTime(ss, node._nanos, node._suspended_nanos);
+    if(node._max_recursion > 0) ss << " Recursion : max depth " << node._max_recursion << ".";
+    PrintPlacement(ss, node._numa_hits.data(), node._numa_nanos.data(), node._numa_hits.size());
+    if(node._counters._cycles > 0) PrintCounters(ss, node._counters);
+    for(const auto& count : node._counts) PrintCount(ss, count.name().c_str(), count._value, count._rate);
+    ss << '\n';
+}
 
-float cag::NanosToValue(PerfNode::Granularity g, std::uint64_t t)
+void cag::PerfNode::print(std::stringstream& ss) const
 {
-    switch (g)
-    {
-        case PerfNode::Granularity::NS: return static_cast<float>(t);
-        case PerfNode::Granularity::US: return static_cast<float>(t) / 0x3E8ULL;
-        case PerfNode::Granularity::MS: return static_cast<float>(t) / 0xF4240ULL;
-        case PerfNode::Granularity::S : return static_cast<float>(t) / 0x3B9ACA00ULL;
-    }
-    return 0.0f;
+    // Indent this node from parent count
+    for(int i = 0; i < _indent; i++) ss << '\t';
+
+    TextBuffer line;
+    PrintNode(line, *this);
+    ss << line._text;
 }
 
-cag::PerfNode::Granularity cag::FindCommonGranularity(PerfNode::Granularity g1, PerfNode::Granularity g2)
+// =================================
+// Clock
+// =================================
+static std::atomic<bool> clock_hardware(false);
+static double clock_nanos_per_tick = 1.0;
+
+static std::uint64_t ReadChronoTicks()
 {
-    using UnderlyingType = std::underlying_type<PerfNode::Granularity>::type;
-    PerfNode::Granularity g_common = static_cast<PerfNode::Granularity>(std::max(
-        static_cast<UnderlyingType>(g1), static_cast<UnderlyingType>(g2)
-    ));
-    return g_common;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::high_resolution_clock::now().time_since_epoch()
+    ).count();
 }
 
-std::shared_ptr<cag::PerfTimer> cag::PerfTimer::MakePerfTimer(const std::string& name, int line, const std::string& suffix)
+#if defined(ST_HW_CLOCK_X86)
+static bool clock_has_rdtscp = false;
+
+static void CpuId(unsigned int leaf, unsigned int regs[4])
 {
-    return std::shared_ptr<PerfTimer>(new PerfTimer(name, line, suffix));
+#if defined(_MSC_VER)
+    int iregs[4];
+    __cpuid(iregs, static_cast<int>(leaf));
+    for(int i = 0; i < 4; i++) regs[i] = static_cast<unsigned int>(iregs[i]);
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    __get_cpuid(leaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
 }
 
-static std::uint64_t GetThreadIdSFF(const std::thread::id& id)
+static bool HardwareClockAvailable()
 {
-    static std::unordered_map<std::thread::id, std::uint64_t> sff_id;
-    static std::uint64_t inc = 0ULL;
-    
-    auto sid = sff_id.find(id);
-    if(sid != sff_id.end()) return sid->second;
+    unsigned int regs[4];
+    CpuId(0x80000000U, regs);
+    if(regs[0] < 0x80000007U) return false;
 
-    sff_id.emplace(id, inc);
-    return inc++;
+    CpuId(0x80000001U, regs);
+    clock_has_rdtscp = (regs[3] & (1U << 27)) != 0;
+
+    // Invariant TSC : constant rate across P/C states
+    CpuId(0x80000007U, regs);
+    return (regs[3] & (1U << 8)) != 0;
 }
 
-static void GetStatisticsFullInternal(std::stringstream& ss, const cag::PerfNode& node)
+static std::uint64_t ReadHardwareTicks()
 {
-    node.print(ss);
-    for(const auto& child : node._children)
+    return __rdtsc();
+}
+
+static std::uint64_t ReadHardwareTicksEnd()
+{
+    // rdtscp waits for the measured instructions to retire
+    if(clock_has_rdtscp)
     {
-        GetStatisticsFullInternal(ss, child);
+        unsigned int aux;
+        return __rdtscp(&aux);
     }
+    return __rdtsc();
+}
+#elif defined(ST_HW_CLOCK_ARM64)
+static bool HardwareClockAvailable()
+{
+    return true;
 }
 
-void cag::PerfTimer::ResetCounters()
+static std::uint64_t ReadHardwareTicks()
 {
-    // Invalidate storage and ptr stack for all threads
-    std::lock_guard<std::mutex> lock(_scope_stack_guard);
-    _parents.clear();
-    _scope_stack.clear();
-    _timer_stack.clear();
+    std::uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+}
+
+static std::uint64_t ReadHardwareTicksEnd()
+{
+    std::uint64_t ticks;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+    return ticks;
 }
+#endif
 
+static double CalibrateHardwareClock()
+{
+#if defined(ST_HW_CLOCK_ARM64)
+    // The generic timer reports its own frequency
+    std::uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    if(frequency != 0) return 1.0E9 / static_cast<double>(frequency);
+#endif
+#if defined(ST_HW_CLOCK_X86) || defined(ST_HW_CLOCK_ARM64)
+    // Busy wait a few ms against the steady clock
+    const auto t0 = std::chrono::steady_clock::now();
+    const std::uint64_t ticks0 = ReadHardwareTicks();
+    auto t1 = t0;
+    while(t1 - t0 < std::chrono::milliseconds(5)) t1 = std::chrono::steady_clock::now();
+    const std::uint64_t ticks1 = ReadHardwareTicks();
 
-void cag::PerfTimer::StopCounters()
+    const double nanos = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+    if(ticks1 > ticks0) return nanos / static_cast<double>(ticks1 - ticks0);
+#endif
+    return 0.0;
+}
+
+static bool SelectClock(cag::PerfClockSource source)
 {
-    // Stop all the running counters ordered for all threads
-    std::lock_guard<std::mutex> lock(_scope_stack_guard);
-    for(auto& stack : _timer_stack)
+    if(source == cag::PerfClockSource::Chrono)
     {
-        while(!stack.second.empty())
-        {
-            auto& top_timer = stack.second.top();
-            top_timer.lock()->stop();
-        }
+        clock_hardware.store(false);
+        return true;
     }
+
+#if defined(ST_HW_CLOCK_X86) || defined(ST_HW_CLOCK_ARM64)
+    // Calibrate only once, the ratio does not change for an invariant counter
+    static const bool available = HardwareClockAvailable() && (clock_nanos_per_tick = CalibrateHardwareClock()) > 0.0;
+    clock_hardware.store(available);
+    return available;
+#else
+    clock_hardware.store(false);
+    return false;
+#endif
 }
 
-static cag::PerfNode ReduceChildren(const std::vector<std::vector<cag::PerfNode>::const_iterator>& nodes)
+static void InitClock()
 {
-    using PerfNodeConstIt = std::vector<cag::PerfNode>::const_iterator;
+    // Auto select on first use
+    static const bool hardware = SelectClock(cag::PerfClockSource::Auto);
+    static_cast<void>(hardware);
+}
 
-    const cag::PerfNode& first = *nodes.front();
-    cag::PerfNode reduced;
+static inline std::uint64_t ReadClock()
+{
+#if defined(ST_HW_CLOCK_X86) || defined(ST_HW_CLOCK_ARM64)
+    if(clock_hardware.load(std::memory_order_relaxed)) return ReadHardwareTicks();
+#endif
+    return ReadChronoTicks();
+}
 
-    reduced._name = first._name;
-    reduced._indent = first._indent;
-    reduced._pct = first._pct;
-    reduced._nanos = std::accumulate(nodes.begin(), nodes.end(), std::uint64_t(0), [](std::uint64_t sum, PerfNodeConstIt node_it) {
-        return sum + node_it->_nanos;
-    });
+static inline std::uint64_t ReadClockEnd()
+{
+#if defined(ST_HW_CLOCK_X86) || defined(ST_HW_CLOCK_ARM64)
+    if(clock_hardware.load(std::memory_order_relaxed)) return ReadHardwareTicksEnd();
+#endif
+    return ReadChronoTicks();
+}
 
-    auto granularity = cag::FindTimeGranularity(reduced._nanos);
-    reduced._granularity = granularity;
-    reduced._value = cag::NanosToValue(granularity, reduced._nanos);
-    reduced._hits = nodes.size();
+static inline std::uint64_t TicksToNanos(std::uint64_t ticks)
+{
+    if(clock_hardware.load(std::memory_order_relaxed))
+    {
+        return static_cast<std::uint64_t>(static_cast<double>(ticks) * clock_nanos_per_tick);
+    }
+    return ticks;
+}
 
-    for(auto& child : nodes)
+static inline std::uint64_t NanosToTicks(std::uint64_t nanos)
+{
+    if(clock_hardware.load(std::memory_order_relaxed))
     {
-        reduced._children.insert(reduced._children.end(), child->_children.begin(), child->_children.end());
+        return static_cast<std::uint64_t>(static_cast<double>(nanos) / clock_nanos_per_tick);
     }
+    return nanos;
+}
 
-    return reduced;
+// =================================
+// Thread CPU time
+// =================================
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+static bool ReadThreadCpuNanos(std::uint64_t& nanos)
+{
+    timespec ts;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) return false;
+    nanos = static_cast<std::uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<std::uint64_t>(ts.tv_nsec);
+    return true;
 }
+#else
+static bool ReadThreadCpuNanos(std::uint64_t& nanos)
+{
+    nanos = 0;
+    return false;
+}
+#endif
+
+// =================================
+// Hardware counters
+// =================================
+constexpr std::uint32_t cag::PerfCounters::COUNT;
+
+#if defined(ST_PERF_EVENTS)
+// Same order as PerfCounters, the first one leads the group
+static const std::uint64_t counter_configs[cag::PerfCounters::COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
 
-static std::unordered_map<std::string, std::vector<std::vector<cag::PerfNode>::const_iterator>> ComputeTreeLevelMap(const std::vector<cag::PerfNode>& level)
+struct cag::PerfCounterGroup
 {
-    std::unordered_map<std::string, std::vector<std::vector<cag::PerfNode>::const_iterator>> storage;
-    
-    // Get child with the same name to collapse
-    for(auto it = level.begin(); it != level.end(); it++)
+    int _fds[PerfCounters::COUNT];
+    const perf_event_mmap_page* _pages[PerfCounters::COUNT]; // Only mapped where rdpmc can be used
+    std::size_t _page_size;
+
+    PerfCounterGroup() : _page_size(static_cast<std::size_t>(sysconf(_SC_PAGESIZE)))
     {
-        if(storage.find(it->_name) != storage.end())
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
         {
-            storage[it->_name].push_back(it);
+            _fds[i] = -1;
+            _pages[i] = nullptr;
         }
-        else
+    }
+
+    ~PerfCounterGroup()
+    {
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
         {
-            storage[it->_name] = { it };
+            if(_pages[i] != nullptr) munmap(const_cast<perf_event_mmap_page*>(_pages[i]), _page_size);
+            if(_fds[i] >= 0) close(_fds[i]);
         }
     }
-    return storage;
-}
 
-static cag::PerfNode ComputeNodesCollapse(const cag::PerfNode& root)
-{
-    // Skip nodes without children
-    if(root._children.empty()) return root;
+    bool open()
+    {
+        // User space only, counting the calling thread on whatever cpu it runs
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = counter_configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            _fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : _fds[0], 0));
 
-    cag::PerfNode clean_root = root;
-    clean_root._children.clear();
+            // Without the leader there is nothing, a missing member just reads 0
+            if(_fds[0] < 0) return false;
+        }
 
-    // Get child with the same name to collapse
-    std::unordered_map<std::string, std::vector<std::vector<cag::PerfNode>::const_iterator>> storage = ComputeTreeLevelMap(root._children);
-    
-    // Iterate over each unique children type
-    for(auto& kv : storage)
+#if defined(ST_HW_CLOCK_X86)
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
+        {
+            if(_fds[i] < 0) continue;
+            void* const page = mmap(nullptr, _page_size, PROT_READ, MAP_SHARED, _fds[i], 0);
+            _pages[i] = page != MAP_FAILED ? static_cast<const perf_event_mmap_page*>(page) : nullptr;
+        }
+#endif
+        return true;
+    }
+
+    void read(std::uint64_t values[PerfCounters::COUNT]) const
+    {
+#if defined(ST_HW_CLOCK_X86)
+        // rdpmc avoids a syscall, fall back when a counter is not scheduled on the cpu right now
+        bool user_read = true;
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT && user_read; i++)
+        {
+            if(_fds[i] < 0) values[i] = 0;
+            else user_read = _pages[i] != nullptr && ReadUser(_pages[i], values[i]);
+        }
+        if(user_read) return;
+#endif
+
+        // Group read, { nr, values[nr] } in the order the members were opened
+        std::uint64_t buffer[PerfCounters::COUNT + 1];
+        const ssize_t size = ::read(_fds[0], buffer, sizeof(buffer));
+        std::uint64_t next = 1;
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
+        {
+            values[i] = 0;
+            if(_fds[i] < 0 || size <= 0 || next > buffer[0]) continue;
+            values[i] = buffer[next++];
+        }
+    }
+
+#if defined(ST_HW_CLOCK_X86)
+    static bool ReadUser(const perf_event_mmap_page* page, std::uint64_t& value)
     {
-        cag::PerfNode reduced_child = ReduceChildren(kv.second);
-        cag::PerfNode reduced_child_collapsed = ComputeNodesCollapse(reduced_child);
-        clean_root._children.push_back(reduced_child_collapsed);
+        // Seqlock against the kernel updating offset/index on a context switch
+        const volatile std::uint32_t* const lock = &page->lock;
+        std::uint32_t sequence;
+        do
+        {
+            sequence = *lock;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            const std::uint32_t index = page->index;
+            if(!page->cap_user_rdpmc || index == 0) return false;
+
+            const std::uint32_t shift = 64 - page->pmc_width;
+            const std::uint64_t raw = static_cast<std::uint64_t>(__rdpmc(static_cast<int>(index - 1))) << shift;
+            value = static_cast<std::uint64_t>(page->offset + (static_cast<std::int64_t>(raw) >> shift));
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        } while(*lock != sequence);
+        return true;
     }
+#endif
+};
+#else
+struct cag::PerfCounterGroup
+{
+    bool open() { return false; }
+    void read(std::uint64_t values[PerfCounters::COUNT]) const { for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++) values[i] = 0; }
+};
+#endif
 
-    return clean_root;
+// =================================
+// Thread identity and placement
+// =================================
+#if defined(ST_PERF_EVENTS)
+static int ReadCurrentCpu()
+{
+    return sched_getcpu();
 }
 
-static float CalculateRootRelativePct(const cag::PerfNode& root, const cag::PerfNode& node)
+static std::uint64_t ReadOsThreadId()
 {
-    auto granularity = cag::FindCommonGranularity(node._granularity, root._granularity);
-    return cag::NanosToValue(granularity, node._nanos) / cag::NanosToValue(granularity, root._nanos);
-    // return static_cast<float>(node._nanos) / root._nanos;
+    return static_cast<std::uint64_t>(syscall(SYS_gettid));
+}
+#elif defined(__APPLE__)
+static int ReadCurrentCpu()
+{
+    return -1;
 }
 
-static void CalculateTreeRelativePct(cag::PerfNode& root, std::vector<cag::PerfNode>& children)
+static std::uint64_t ReadOsThreadId()
 {
-    for(auto& child : children)
+    std::uint64_t tid = 0;
+    pthread_threadid_np(nullptr, &tid);
+    return tid;
+}
+#else
+static int ReadCurrentCpu()
+{
+    return -1;
+}
+
+static std::uint64_t ReadOsThreadId()
+{
+    return 0;
+}
+#endif
+
+static std::string ReadOsThreadName()
+{
+#if defined(ST_PERF_EVENTS) || defined(__APPLE__)
+    char name[64] = {  };
+    if(pthread_getname_np(pthread_self(), name, sizeof(name)) == 0) return name;
+#endif
+    return std::string();
+}
+
+// "0-3,8-11" as found in sysfs cpulist files
+static void ParseCpuList(const std::string& list, std::uint32_t node, std::vector<std::uint32_t>& cpu_nodes)
+{
+    std::istringstream ss(list);
+    std::string range;
+    while(std::getline(ss, range, ','))
     {
-        child._pct = CalculateRootRelativePct(root, child);
-        CalculateTreeRelativePct(root, child._children);
+        unsigned first = 0;
+        unsigned last = 0;
+        const int fields = sscanf(range.c_str(), "%u-%u", &first, &last);
+        if(fields < 1) continue;
+        if(fields == 1) last = first;
+        if(last >= cpu_nodes.size()) cpu_nodes.resize(last + 1, 0);
+        for(unsigned cpu = first; cpu <= last; cpu++) cpu_nodes[cpu] = node;
     }
 }
 
-std::unordered_map<std::thread::id, std::vector<cag::PerfNode>> cag::PerfTimer::GetCallTree()
+struct NumaTopology
 {
-    using RType = std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>;
-    if(_parents.empty()) return RType();
+    std::vector<std::uint32_t> _cpu_nodes; // By CPU number, CPUs past the end are on node 0
+    std::uint32_t _nodes;
 
-    RType output;
-    
-    for(auto& thread_parents : _parents)
+    NumaTopology() : _nodes(1)
     {
-        if(thread_parents.second.empty()) output.emplace(thread_parents.first, std::vector<cag::PerfNode>());
-
-        std::vector<cag::PerfNode> crunched_data;
-        crunched_data.reserve(thread_parents.second.size());
-        for(const auto& parent : thread_parents.second)
+#if defined(ST_PERF_EVENTS)
+        DIR* dir = opendir("/sys/devices/system/node");
+        if(dir == nullptr) return;
+        for(dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir))
         {
-            // NOTE: (César) Not sure if this is useful here or not
-            std::lock_guard<std::mutex> lock(_scope_stack_guard);
+            unsigned node = 0;
+            if(strncmp(entry->d_name, "node", 4) != 0 || sscanf(entry->d_name + 4, "%u", &node) != 1) continue;
 
-            crunched_data.push_back(ComputeNodesCollapse(parent));
-            auto& root = crunched_data.back();
-            root._pct = CalculateRootRelativePct(root, root);
-            CalculateTreeRelativePct(root, root._children);
+            std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            std::string list;
+            if(!std::getline(file, list)) continue;
+            ParseCpuList(list, node, _cpu_nodes);
+            _nodes = std::max(_nodes, static_cast<std::uint32_t>(node) + 1);
         }
+        closedir(dir);
+#endif
+    }
 
-        // Now crunch the parents (root might not be main/called only once)
-        auto storage = ComputeTreeLevelMap(crunched_data);
-        
-        // Iterate over each unique parent type
-        std::vector<cag::PerfNode> thread_tree;
-        for(auto& kv : storage)
-        {
-            cag::PerfNode reduced = ReduceChildren(kv.second);
-            thread_tree.push_back(reduced);
-        }
-        output.emplace(thread_parents.first, thread_tree);
+    std::uint32_t node(int cpu) const
+    {
+        return static_cast<std::size_t>(cpu) < _cpu_nodes.size() ? _cpu_nodes[cpu] : 0;
     }
-    return output;
+};
+
+static const NumaTopology& GetNumaTopology()
+{
+    static const NumaTopology topology;
+    return topology;
 }
 
-std::string cag::PerfTimer::GetCallTreeString(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree)
+struct ThreadIdentity
 {
-    std::stringstream ss;
-    for(const auto& thread_root : tree)
+    std::uint64_t _os_tid;
+    std::string _name;
+    bool _named; // By SetThreadName, the OS name is not read again
+};
+
+// Report index and identity of every thread seen, indices are never reused
+struct ThreadRegistry
+{
+    std::mutex _guard;
+    std::unordered_map<std::thread::id, std::uint64_t> _ids;
+    std::vector<ThreadIdentity> _threads; // By report index
+
+    std::uint64_t index(const std::thread::id& id)
     {
-        ss << "[Thread - " << GetThreadIdSFF(thread_root.first) << "]" << std::endl;
-        for(const auto& node : thread_root.second)
-        { 
-            GetStatisticsFullInternal(ss, node);
-        }
+        auto sid = _ids.find(id);
+        if(sid != _ids.end()) return sid->second;
+
+        _ids.emplace(id, _threads.size());
+        _threads.push_back({ 0, std::string(), false });
+        return _threads.size() - 1;
     }
-    return ss.str();
-}
+};
 
-static std::string GenDotHeader()
+static ThreadRegistry& GetThreadRegistry()
 {
-    return "digraph stperf_info {\nnode[shape=box];\n"; 
+    static ThreadRegistry registry;
+    return registry;
 }
 
-static std::string GenDotFooter()
+static std::uint64_t GetThreadIdSFF(const std::thread::id& id)
 {
-    return "}";
+    ThreadRegistry& registry = GetThreadRegistry();
+    std::lock_guard<std::mutex> lock(registry._guard);
+    return registry.index(id);
 }
 
-// TODO: (César) : Switch to graphviz html tags
-static std::string GenNodeData(const cag::PerfNode& node)
+static ThreadIdentity GetThreadIdentity(std::uint64_t tid)
 {
-    std::stringstream ss;
-    ss << " [";
-
-    // Label
-    const auto default_precision = std::cout.precision();
-    ss << "label=\"{ { " << node._name << " | {" <<
-        node._hits << " hit" << ((node._hits > 1) ? "s" : "") << " | " << 
-        node._value << cag::PerfNode::_time_suffix.at(node._granularity) << "} | " <<
-        std::setw(3) << std::setprecision(4) << 
-        node._pct * 100 << std::setprecision(default_precision) << "% } }\"";
-
-    // Color
-    ss << "style=filled fillcolor=white";
+    ThreadRegistry& registry = GetThreadRegistry();
+    std::lock_guard<std::mutex> lock(registry._guard);
+    return tid < registry._threads.size() ? registry._threads[tid] : ThreadIdentity{ 0, std::string(), false };
+}
 
-    ss << "];";
-    return ss.str();
+// Called by the thread itself, a new thread reusing an old std::thread::id drops the old name
+static void CaptureThreadIdentity(bool new_thread)
+{
+    const std::uint64_t os_tid = ReadOsThreadId();
+    ThreadRegistry& registry = GetThreadRegistry();
+    std::lock_guard<std::mutex> lock(registry._guard);
+    ThreadIdentity& identity = registry._threads[registry.index(std::this_thread::get_id())];
+    identity._os_tid = os_tid;
+    if(new_thread) identity._named = false;
+    if(!identity._named) identity._name = ReadOsThreadName();
 }
 
-static void GenDotChildSection(const std::vector<cag::PerfNode>& nodes, size_t& i, std::stringstream& ss, const std::string& parent)
+// Samples the CPU running the calling thread, returns its NUMA node
+static std::uint32_t SamplePlacement(cag::PerfThreadContext* ctx)
 {
-    for(const auto& node : nodes)
+    const int cpu = ReadCurrentCpu();
+    if(cpu < 0) return UINT32_MAX;
+    const std::uint32_t numa = GetNumaTopology().node(cpu);
+
+    // Single writer, relaxed load and store are enough
+    const std::uint32_t last_cpu = ctx->_last_cpu.load(std::memory_order_relaxed);
+    if(last_cpu == static_cast<std::uint32_t>(cpu)) return numa;
+    if(last_cpu != UINT32_MAX)
     {
-        const std::string dot_name = "Node" + std::to_string(i++);
-        
-        // Generate self
-        ss << dot_name << GenNodeData(node) << "\n";
-        ss << parent << " -> " << dot_name << ";\n";
-        
-        // Generate children
-        if(!node._children.empty())
+        ctx->_cpu_migrations.store(ctx->_cpu_migrations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if(ctx->_last_numa.load(std::memory_order_relaxed) != numa)
         {
-            GenDotChildSection(node._children, i, ss, dot_name);
+            ctx->_numa_migrations.store(ctx->_numa_migrations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
         }
     }
+    ctx->_last_cpu.store(static_cast<std::uint32_t>(cpu), std::memory_order_relaxed);
+    ctx->_last_numa.store(numa, std::memory_order_relaxed);
+    return numa;
 }
 
-static std::string GenDotThreadSection(const std::vector<cag::PerfNode>& root, const std::uint64_t tid)
+// =================================
+// PerfTimer
+// =================================
+thread_local cag::PerfThreadContext* cag::PerfTimer::_context = nullptr;
+decltype(cag::PerfTimer::_contexts) cag::PerfTimer::_contexts;
+decltype(cag::PerfTimer::_contexts_guard) cag::PerfTimer::_contexts_guard;
+decltype(cag::PerfTimer::_snapshot_guard) cag::PerfTimer::_snapshot_guard;
+decltype(cag::PerfTimer::_generation) cag::PerfTimer::_generation(0);
+decltype(cag::PerfTimer::_scope_overhead) cag::PerfTimer::_scope_overhead(-1.0);
+decltype(cag::PerfTimer::_overhead_compensation) cag::PerfTimer::_overhead_compensation(false);
+decltype(cag::PerfTimer::_trace_enabled) cag::PerfTimer::_trace_enabled(false);
+decltype(cag::PerfTimer::_histograms_enabled) cag::PerfTimer::_histograms_enabled(false);
+decltype(cag::PerfTimer::_counters_enabled) cag::PerfTimer::_counters_enabled(false);
+decltype(cag::PerfTimer::_cpu_time_enabled) cag::PerfTimer::_cpu_time_enabled(false);
+decltype(cag::PerfTimer::_placement_enabled) cag::PerfTimer::_placement_enabled(false);
+decltype(cag::PerfTimer::_trace_capacity) cag::PerfTimer::_trace_capacity(1ULL << 16);
+decltype(cag::PerfTimer::_max_depth) cag::PerfTimer::_max_depth(0);
+decltype(cag::PerfTimer::_max_nodes) cag::PerfTimer::_max_nodes(0);
+decltype(cag::PerfTimer::_recursion_collapse) cag::PerfTimer::_recursion_collapse(false);
+decltype(cag::PerfTimer::_sites) cag::PerfTimer::_sites;
+decltype(cag::PerfTimer::_sites_guard) cag::PerfTimer::_sites_guard;
+decltype(cag::PerfTimer::_site_index) cag::PerfTimer::_site_index = {  };
+decltype(cag::PerfTimer::_site_count) cag::PerfTimer::_site_count(0);
+decltype(cag::PerfTimer::_task_tree) cag::PerfTimer::_task_tree(1);
+decltype(cag::PerfTimer::_task_guard) cag::PerfTimer::_task_guard;
+constexpr std::uint32_t cag::PerfTimer::SITE_CHUNK_BITS;
+constexpr std::uint32_t cag::PerfTimer::SITE_CHUNKS;
+
+// Flags the context of an exiting thread so a reset can drop it
+struct PerfThreadContextReaper
 {
-    std::stringstream ss;
-    ss << "subgraph cluster_stperf_info_thread_" + std::to_string(tid) + "{\n";
-    ss << "node [shape=record];\n";
-    ss << "style=filled;\n";
-    ss << "color=black;\n";
-    ss << "fillcolor=lightgrey;\n";
-    
-    size_t i = 0;
-    for(const auto& node : root)
-    {
-        const std::string dot_name = "Node" + std::to_string(i++);
+    cag::PerfThreadContext* _ctx = nullptr;
+    ~PerfThreadContextReaper() { if(_ctx != nullptr) _ctx->_alive.store(false); }
+};
+
+cag::PerfTraceRing::PerfTraceRing(std::uint64_t capacity) :
+    _capacity(capacity), _claimed(0), _head(0), _floor(0), _events(new PerfTraceEvent[capacity])
+{  }
+
+void cag::PerfTraceRing::push(std::uint32_t id, std::uint64_t ticks, PerfTraceEvent::Kind kind)
+{
+    // Only the owner thread writes, readers detect overwritten slots via _claimed
+    const std::uint64_t head = _head.load(std::memory_order_relaxed);
+    _claimed.store(head + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    PerfTraceEvent& event = _events[head & (_capacity - 1)];
+    event._ticks.store(ticks, std::memory_order_relaxed);
+    event._id.store(id, std::memory_order_relaxed);
+    event._kind.store(kind, std::memory_order_relaxed);
+
+    _head.store(head + 1, std::memory_order_release);
+}
+
+cag::PerfTreeNode::PerfTreeNode() :
+    _id(0), _last_child(0), _first_child(0), _next_sibling(0), _nanos(0), _hits(0), _raw_nanos(0), _raw_hits(0), _histogram(nullptr), _cpu_nanos(0), _counts(nullptr),
+    _recursion(nullptr), _folded_hits(0), _placement(nullptr)
+{
+    for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++) _counters[i].store(0, std::memory_order_relaxed);
+}
+
+cag::PerfTreeNode::~PerfTreeNode()
+{
+    delete _histogram.load(std::memory_order_relaxed);
+    delete _recursion.load(std::memory_order_relaxed);
+    delete _placement.load(std::memory_order_relaxed);
+    for(PerfCountSlot* slot = _counts.load(std::memory_order_relaxed); slot != nullptr;)
+    {
+        PerfCountSlot* const next = slot->_next;
+        delete slot;
+        slot = next;
+    }
+}
+
+cag::PerfCountSlot::PerfCountSlot(std::uint32_t id, PerfCountSlot* next) :
+    _id(id), _value(0), _samples(0), _min(UINT64_MAX), _max(0), _next(next)
+{  }
+
+cag::PerfPlacementCounts::PerfPlacementCounts(std::uint32_t nodes) :
+    _nodes(nodes), _hits(new std::atomic<std::uint64_t>[nodes]), _nanos(new std::atomic<std::uint64_t>[nodes])
+{
+    for(std::uint32_t i = 0; i < nodes; i++)
+    {
+        _hits[i].store(0, std::memory_order_relaxed);
+        _nanos[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+constexpr std::uint32_t cag::PerfRecursionHistogram::BUCKETS;
+
+cag::PerfRecursionHistogram::PerfRecursionHistogram() : _max_depth(0)
+{
+    for(std::uint32_t i = 0; i < BUCKETS; i++) _counts[i].store(0, std::memory_order_relaxed);
+}
+
+static inline std::uint32_t FloorLog2(std::uint32_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return static_cast<std::uint32_t>(index);
+#else
+    return 31U - static_cast<std::uint32_t>(__builtin_clz(value));
+#endif
+}
+
+static inline std::uint32_t FloorLog2(std::uint64_t value)
+{
+    const std::uint32_t high = static_cast<std::uint32_t>(value >> 32);
+    return high != 0 ? 32U + FloorLog2(high) : FloorLog2(static_cast<std::uint32_t>(value));
+}
+
+constexpr std::uint32_t cag::PerfHistogram::SUB_BITS;
+constexpr std::uint32_t cag::PerfHistogram::MAX_EXPONENT;
+constexpr std::uint32_t cag::PerfHistogram::BUCKETS;
+
+cag::PerfHistogram::PerfHistogram() : _min_nanos(UINT64_MAX), _max_nanos(0)
+{
+    for(std::uint32_t i = 0; i < BUCKETS; i++) _counts[i].store(0, std::memory_order_relaxed);
+}
+
+std::uint32_t cag::PerfHistogram::BucketIndex(std::uint64_t nanos)
+{
+    // Values below 2^SUB_BITS are exact, above that each power of two gets 2^SUB_BITS buckets
+    if(nanos < (1ULL << SUB_BITS)) return static_cast<std::uint32_t>(nanos);
+    const std::uint32_t exponent = FloorLog2(nanos);
+    if(exponent > MAX_EXPONENT) return BUCKETS - 1;
+    const std::uint32_t sub = static_cast<std::uint32_t>(nanos >> (exponent - SUB_BITS)) & ((1U << SUB_BITS) - 1);
+    return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+std::uint64_t cag::PerfHistogram::BucketValue(std::uint32_t index)
+{
+    // Middle of the bucket's range
+    if(index < (1U << SUB_BITS)) return index;
+    const std::uint32_t exponent = (index >> SUB_BITS) + SUB_BITS - 1;
+    const std::uint64_t sub = index & ((1U << SUB_BITS) - 1);
+    const std::uint64_t width = 1ULL << (exponent - SUB_BITS);
+    return (((1ULL << SUB_BITS) + sub) << (exponent - SUB_BITS)) + width / 2;
+}
+
+void cag::PerfHistogram::record(std::uint64_t nanos, std::uint64_t weight)
+{
+    // Single writer, O(1) per scope exit
+    std::atomic<std::uint64_t>& count = _counts[BucketIndex(nanos)];
+    count.store(count.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+    if(nanos < _min_nanos.load(std::memory_order_relaxed)) _min_nanos.store(nanos, std::memory_order_relaxed);
+    if(nanos > _max_nanos.load(std::memory_order_relaxed)) _max_nanos.store(nanos, std::memory_order_relaxed);
+}
+
+cag::PerfTree::PerfTree() : _size(1)
+{
+    for(std::uint32_t i = 0; i < MAX_CHUNKS; i++) _chunks[i].store(nullptr, std::memory_order_relaxed);
+    _chunks[0].store(new PerfTreeNode[1U << FIRST_CHUNK_BITS], std::memory_order_release);
+}
+
+cag::PerfTree::~PerfTree()
+{
+    for(std::uint32_t i = 0; i < MAX_CHUNKS; i++) delete[] _chunks[i].load(std::memory_order_relaxed);
+}
+
+cag::PerfTreeNode& cag::PerfTree::node(std::uint32_t index) const
+{
+    // Chunk k holds 2^(k + FIRST_CHUNK_BITS) nodes
+    const std::uint32_t biased = index + (1U << FIRST_CHUNK_BITS);
+    const std::uint32_t chunk = FloorLog2(biased) - FIRST_CHUNK_BITS;
+    return _chunks[chunk].load(std::memory_order_acquire)[biased - (1U << (chunk + FIRST_CHUNK_BITS))];
+}
+
+cag::PerfTreeNode* cag::PerfTree::firstChild(const PerfTreeNode& parent) const
+{
+    const std::uint32_t index = parent._first_child.load(std::memory_order_acquire);
+    return index != 0 ? &node(index) : nullptr;
+}
+
+cag::PerfTreeNode* cag::PerfTree::nextSibling(const PerfTreeNode& child) const
+{
+    const std::uint32_t index = child._next_sibling.load(std::memory_order_acquire);
+    return index != 0 ? &node(index) : nullptr;
+}
+
+cag::PerfTreeNode* cag::PerfTree::findChild(const PerfTreeNode* parent, std::uint32_t id) const
+{
+    if(parent == nullptr) return nullptr;
+
+    // Same timer under the same parent is the same call path
+    for(PerfTreeNode* child = firstChild(*parent); child != nullptr; child = nextSibling(*child))
+    {
+        if(child->_id == id) return child;
+    }
+    return nullptr;
+}
+
+cag::PerfTreeNode* cag::PerfTree::findOrAddChild(PerfTreeNode* parent, std::uint32_t id)
+{
+    if(parent == nullptr) return nullptr;
+
+    PerfTreeNode* const existing = findChild(parent, id);
+    if(existing != nullptr) return existing;
+
+    const std::uint32_t index = _size.load(std::memory_order_relaxed);
+    const std::uint32_t biased = index + (1U << FIRST_CHUNK_BITS);
+    const std::uint32_t chunk = FloorLog2(biased) - FIRST_CHUNK_BITS;
+
+    // Tree is full, the scope is not recorded
+    if(chunk >= MAX_CHUNKS) return nullptr;
+
+    // Bump allocation, a new chunk is only needed when crossing a power of two
+    if(_chunks[chunk].load(std::memory_order_relaxed) == nullptr)
+    {
+        _chunks[chunk].store(new PerfTreeNode[1U << (chunk + FIRST_CHUNK_BITS)], std::memory_order_release);
+    }
+    _size.store(index + 1, std::memory_order_relaxed);
+
+    PerfTreeNode* const child = &node(index);
+    child->_id = id;
+
+    // Publish the fully built node, snapshots may be walking the siblings right now
+    if(parent->_last_child == 0) parent->_first_child.store(index, std::memory_order_release);
+    else node(parent->_last_child)._next_sibling.store(index, std::memory_order_release);
+    parent->_last_child = index;
+    return child;
+}
+
+cag::PerfThreadContext::PerfThreadContext(std::uint64_t generation) :
+    _thread_id(std::this_thread::get_id()), _generation(generation), _alive(true), _tree(new PerfTree()),
+    _unsampled_depth(0), _sample_state(std::hash<std::thread::id>()(std::this_thread::get_id()) | 1ULL), _trace(nullptr),
+    _counters_failed(false), _last_cpu(UINT32_MAX), _last_numa(UINT32_MAX), _cpu_migrations(0), _numa_migrations(0)
+{  }
+
+cag::PerfThreadContext::~PerfThreadContext()
+{
+    delete _tree.load();
+}
+
+void cag::PerfThreadContext::reset(std::uint64_t generation)
+{
+    // A snapshot might still be reading the old tree, the next one frees it
+    {
+        std::lock_guard<std::mutex> lock(_retired_guard);
+        _retired.emplace_back(_tree.load(std::memory_order_relaxed));
+        _tree.store(new PerfTree(), std::memory_order_release);
+    }
+
+    _scope_stack = std::stack<PerfScopeFrame>();
+    _unsampled_depth = 0;
+    _cpu_migrations.store(0, std::memory_order_relaxed);
+    _numa_migrations.store(0, std::memory_order_relaxed);
+    CaptureThreadIdentity(false);
+
+    // Older events are no longer visible to trace snapshots
+    PerfTraceRing* const trace = _trace.load(std::memory_order_relaxed);
+    if(trace != nullptr) trace->_floor.store(trace->_head.load(std::memory_order_relaxed), std::memory_order_release);
+
+    _generation.store(generation, std::memory_order_release);
+}
+
+cag::PerfThreadContext* cag::PerfTimer::RegisterThreadContext()
+{
+    static thread_local PerfThreadContextReaper reaper;
+    InitClock();
+    CaptureThreadIdentity(true);
+
+    PerfThreadContext* ctx = new PerfThreadContext(_generation.load(std::memory_order_acquire));
+
+    {
+        std::lock_guard<std::mutex> lock(_contexts_guard);
+        _contexts.emplace_back(ctx);
+    }
+
+    reaper._ctx = ctx;
+    _context = ctx;
+    return ctx;
+}
+
+std::vector<cag::PerfThreadContext*> cag::PerfTimer::CopyContexts()
+{
+    // Contexts are only freed under _snapshot_guard, the caller holds it so the pointers stay valid
+    std::lock_guard<std::mutex> lock(_contexts_guard);
+    std::vector<PerfThreadContext*> contexts;
+    contexts.reserve(_contexts.size());
+    for(auto& ctx : _contexts) contexts.push_back(ctx.get());
+    return contexts;
+}
+
+cag::PerfThreadContext* cag::PerfTimer::GetThreadContext()
+{
+    PerfThreadContext* ctx = _context;
+    if(ctx == nullptr) return RegisterThreadContext();
+
+    // A reset was issued since we last recorded, drop our own data
+    const std::uint64_t generation = _generation.load(std::memory_order_relaxed);
+    if(ctx->_generation.load(std::memory_order_relaxed) != generation) ctx->reset(generation);
+    return ctx;
+}
+
+cag::PerfSite::PerfSite(const std::string& name, int line, std::uint32_t id, std::uint32_t sample_rate) :
+    _name(name), _line(line), _id(id), _sample_rate(std::max(sample_rate, 1U))
+{  }
+
+cag::PerfTimer::PerfTimer(const std::string& name,
+                              int line,
+                              const std::string& suffix,
+                              std::uint32_t sample_rate) : 
+    _name(nullptr), _suffix(nullptr), _line(line), _sample_rate(sample_rate),
+    _site(&GetSite(RegisterSite(name, line, suffix, sample_rate)))
+{  }
+
+const cag::PerfSite& cag::PerfTimer::registerLazy() const
+{
+    // Several threads might hit a fresh site at once, only one registers it
+    static std::mutex lazy_guard;
+    std::lock_guard<std::mutex> lock(lazy_guard);
+    const PerfSite* site = _site.load(std::memory_order_acquire);
+    if(site == nullptr)
+    {
+        site = &GetSite(RegisterSite(_name, _line, _suffix != nullptr ? _suffix : "", _sample_rate));
+        _site.store(site, std::memory_order_release);
+    }
+    return *site;
+}
+
+const cag::PerfSite& cag::PerfTimer::site() const
+{
+    const PerfSite* const site = _site.load(std::memory_order_acquire);
+    return site != nullptr ? *site : registerLazy();
+}
+
+std::uint32_t cag::PerfTimer::id() const
+{
+    return site()._id;
+}
+
+std::uint32_t cag::PerfTimer::RegisterSite(const std::string& name, int line, const std::string& suffix, std::uint32_t sample_rate)
+{
+    // Append only, ids stay valid (and names stay in place) until the process exits
+    // Ids start at 1, STPERF_NO_SITE (0) is never a site so callers can use it for "not registered yet"
+    std::lock_guard<std::mutex> lock(_sites_guard);
+    const std::uint32_t id = static_cast<std::uint32_t>(_sites.size()) + 1;
+    _sites.emplace_back(name + suffix, line, id, sample_rate);
+
+    // Publish to the lock free index, chunk k holds 2^(k + SITE_CHUNK_BITS) sites
+    const std::uint64_t biased = static_cast<std::uint64_t>(id) + (1ULL << SITE_CHUNK_BITS);
+    const std::uint32_t chunk = FloorLog2(biased) - SITE_CHUNK_BITS;
+    std::atomic<const PerfSite*>* entries = _site_index[chunk].load(std::memory_order_relaxed);
+    if(entries == nullptr)
+    {
+        entries = new std::atomic<const PerfSite*>[1ULL << (chunk + SITE_CHUNK_BITS)]();
+        _site_index[chunk].store(entries, std::memory_order_release);
+    }
+    entries[biased - (1ULL << (chunk + SITE_CHUNK_BITS))].store(&_sites.back(), std::memory_order_release);
+    _site_count.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+const cag::PerfSite* cag::PerfTimer::FindSite(std::uint32_t id)
+{
+    // No lock, safe to call from any thread while others register
+    if(id >= _site_count.load(std::memory_order_acquire)) return nullptr;
+    const std::uint64_t biased = static_cast<std::uint64_t>(id) + (1ULL << SITE_CHUNK_BITS);
+    const std::uint32_t chunk = FloorLog2(biased) - SITE_CHUNK_BITS;
+    const std::atomic<const PerfSite*>* const entries = _site_index[chunk].load(std::memory_order_acquire);
+    return entries[biased - (1ULL << (chunk + SITE_CHUNK_BITS))].load(std::memory_order_acquire);
+}
+
+const cag::PerfSite& cag::PerfTimer::GetSite(std::uint32_t id)
+{
+    return *FindSite(id);
+}
+
+void cag::PerfTimer::SetSampleRate(std::uint32_t id, std::uint32_t rate)
+{
+    // Entries already recorded keep the weight they were taken with
+    GetSite(id)._sample_rate.store(std::max(rate, 1U), std::memory_order_relaxed);
+}
+
+std::uint32_t cag::PerfTimer::GetSampleRate(std::uint32_t id)
+{
+    return GetSite(id)._sample_rate.load(std::memory_order_relaxed);
+}
+
+// Single writer counters, no need for a locked read-modify-write
+static inline void AddRelaxed(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Per thread xorshift, picks 1 in rate entries at random so periodic call patterns do not alias
+static inline bool SampleEntry(std::uint64_t& state, std::uint32_t rate)
+{
+    if(rate <= 1) return true;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (((state >> 32) * rate) >> 32) == 0;
+}
+
+void cag::PerfTimer::start() const
+{
+    EnterSite(site());
+}
+
+void cag::PerfTimer::stop() const
+{
+    ExitSite();
+}
+
+bool cag::PerfTimer::Enter(std::uint32_t id)
+{
+    const PerfSite* const site = FindSite(id);
+    if(site == nullptr) return false;
+    EnterSite(*site);
+    return true;
+}
+
+void cag::PerfTimer::Exit(std::uint32_t id)
+{
+    // Unknown ids never entered, so there is nothing to close
+    if(FindSite(id) != nullptr) ExitSite();
+}
+
+void cag::PerfTimer::EnterSite(const PerfSite& site)
+{
+    PerfThreadContext* const ctx = GetThreadContext();
+
+    // Skipped entries cost no clock read nor tree update, their children are skipped too
+    const std::uint32_t rate = site._sample_rate.load(std::memory_order_relaxed);
+    if(ctx->_unsampled_depth > 0 || !SampleEntry(ctx->_sample_state, rate))
+    {
+        ctx->_unsampled_depth++;
+        return;
+    }
+
+    const std::uint64_t parent_weight = ctx->_scope_stack.empty() ? 1 : ctx->_scope_stack.top()._weight;
+    AddLeaf(ctx, site._id, parent_weight * rate);
+}
+
+void cag::PerfTimer::ExitSite()
+{
+    PerfThreadContext* const ctx = GetThreadContext();
+    if(ctx->_unsampled_depth > 0)
+    {
+        ctx->_unsampled_depth--;
+        return;
+    }
+    StopScope(ctx);
+}
+
+// Outer call of a node, depth counts the calls folded onto it including this one
+static void RecordRecursion(cag::PerfTreeNode* node, std::uint64_t depth)
+{
+    cag::PerfRecursionHistogram* h = node->_recursion.load(std::memory_order_relaxed);
+    if(h == nullptr)
+    {
+        if(depth <= 1) return;
+
+        // Outer calls before the first recursion never recursed, the current one is already in _raw_hits
+        h = new cag::PerfRecursionHistogram();
+        const std::uint64_t calls = node->_raw_hits.load(std::memory_order_relaxed) - node->_folded_hits.load(std::memory_order_relaxed);
+        h->_counts[0].store(calls - std::min<std::uint64_t>(calls, 1), std::memory_order_relaxed);
+        node->_recursion.store(h, std::memory_order_release);
+    }
+    AddRelaxed(h->_counts[std::min(FloorLog2(depth), cag::PerfRecursionHistogram::BUCKETS - 1)], 1);
+    if(depth > h->_max_depth.load(std::memory_order_relaxed)) h->_max_depth.store(depth, std::memory_order_relaxed);
+}
+
+static void RecordPlacement(cag::PerfTreeNode* node, std::uint32_t numa, std::uint64_t nanos, std::uint64_t weight)
+{
+    cag::PerfPlacementCounts* placement = node->_placement.load(std::memory_order_relaxed);
+    if(placement == nullptr)
+    {
+        placement = new cag::PerfPlacementCounts(GetNumaTopology()._nodes);
+        node->_placement.store(placement, std::memory_order_release);
+    }
+    AddRelaxed(placement->_hits[numa], weight);
+    AddRelaxed(placement->_nanos[numa], nanos * weight);
+}
+
+static inline void RecordScope(cag::PerfTreeNode* node, std::uint64_t nanos, std::uint64_t weight, bool histogram)
+{
+    AddRelaxed(node->_nanos, nanos * weight);
+    AddRelaxed(node->_hits, weight);
+    AddRelaxed(node->_raw_nanos, nanos);
+    AddRelaxed(node->_raw_hits, 1);
+
+    if(histogram)
+    {
+        cag::PerfHistogram* h = node->_histogram.load(std::memory_order_relaxed);
+        if(h == nullptr)
+        {
+            h = new cag::PerfHistogram();
+            node->_histogram.store(h, std::memory_order_release);
+        }
+        h->record(nanos, weight);
+    }
+}
+
+void cag::PerfTimer::StopScope(PerfThreadContext* ctx)
+{
+    // Stack is invalid (Maybe a reset call was issued during this prof)
+    if(ctx->_scope_stack.empty()) return;
+
+    const std::uint64_t now = ReadClockEnd();
+    const PerfScopeFrame& frame = ctx->_scope_stack.top();
+    const std::uint64_t ellapsed = TicksToNanos(now - frame._ticks);
+
+    // Only accumulate, the tree shape is already known when we get here
+    if(frame._folded)
+    {
+        StopFoldedScope(ctx, now);
+        return;
+    }
+    if(frame._node != nullptr) RecordScope(frame._node, ellapsed, frame._weight, _histograms_enabled.load(std::memory_order_relaxed));
+    if(frame._node != nullptr && _recursion_collapse.load(std::memory_order_relaxed)) RecordRecursion(frame._node, frame._max_recursion + 1);
+    if(frame._node != nullptr && frame._numa != UINT32_MAX) RecordPlacement(frame._node, frame._numa, ellapsed, frame._weight);
+
+    std::uint64_t cpu_nanos;
+    if(frame._cpu_start != UINT64_MAX && frame._node != nullptr && ReadThreadCpuNanos(cpu_nanos))
+    {
+        AddRelaxed(frame._node->_cpu_nanos, (cpu_nanos - std::min(cpu_nanos, frame._cpu_start)) * frame._weight);
+    }
+
+    std::uint64_t counters[PerfCounters::COUNT];
+    if(frame._counted && frame._node != nullptr && ReadCounters(ctx, counters))
+    {
+        for(std::uint32_t i = 0; i < PerfCounters::COUNT; i++)
+        {
+            AddRelaxed(frame._node->_counters[i], (counters[i] - std::min(counters[i], frame._counters[i])) * frame._weight);
+        }
+    }
+
+    if(_trace_enabled.load(std::memory_order_relaxed)) TraceEvent(ctx, frame._id, now, PerfTraceEvent::End);
+    
+    ctx->_scope_stack.pop();
+}
+
+void cag::PerfTimer::StopFoldedScope(PerfThreadContext* ctx, std::uint64_t now)
+{
+    // The entry that owns the node times the whole span, this one only counts as a call
+    const PerfScopeFrame frame = ctx->_scope_stack.top();
+    if(frame._node != nullptr)
+    {
+        AddRelaxed(frame._node->_hits, frame._weight);
+        AddRelaxed(frame._node->_raw_hits, 1);
+        AddRelaxed(frame._node->_folded_hits, 1);
+    }
+    if(_trace_enabled.load(std::memory_order_relaxed)) TraceEvent(ctx, frame._id, now, PerfTraceEvent::End);
+    ctx->_scope_stack.pop();
+
+    // The entry it folded into is right above, it keeps the deepest level for its outer call
+    if(ctx->_scope_stack.empty()) return;
+    PerfScopeFrame& parent = ctx->_scope_stack.top();
+    parent._max_recursion = std::max(parent._max_recursion, std::max(frame._recursion, frame._max_recursion));
+}
+
+void cag::PerfTimer::TraceEvent(PerfThreadContext* ctx, std::uint32_t id, std::uint64_t ticks, PerfTraceEvent::Kind kind)
+{
+    PerfTraceRing* trace = ctx->_trace.load(std::memory_order_relaxed);
+    const std::uint64_t capacity = _trace_capacity.load(std::memory_order_relaxed);
+    if(trace == nullptr || trace->_capacity != capacity)
+    {
+        // Old rings stay alive with the context, a snapshot might still be reading them
+        ctx->_trace_rings.emplace_back(new PerfTraceRing(capacity));
+        trace = ctx->_trace_rings.back().get();
+        ctx->_trace.store(trace, std::memory_order_release);
+    }
+    trace->push(id, ticks, kind);
+}
+
+bool cag::PerfTimer::ReadCounters(PerfThreadContext* ctx, std::uint64_t values[PerfCounters::COUNT])
+{
+    // A thread that cannot open its group does not retry on every scope
+    if(ctx->_counter_group == nullptr)
+    {
+        if(ctx->_counters_failed) return false;
+        std::unique_ptr<PerfCounterGroup> group(new PerfCounterGroup());
+        if(!group->open())
+        {
+            ctx->_counters_failed = true;
+            return false;
+        }
+        ctx->_counter_group = std::move(group);
+    }
+    ctx->_counter_group->read(values);
+    return true;
+}
+
+// Bucket that takes the scopes past the tree limits, registered on first use
+static std::uint32_t OverflowSite()
+{
+    static const std::uint32_t id = cag::PerfTimer::RegisterSite("[overflow]", 0);
+    return id;
+}
+
+void cag::PerfTimer::AddChild(PerfTree* tree, PerfTreeNode* parent, PerfScopeFrame& frame)
+{
+    frame._node = tree->findChild(parent, frame._id);
+    if(frame._node != nullptr || parent == nullptr) return;
+
+    // Past a limit the scope goes to an overflow child of the parent, the only node added beyond it
+    const std::uint32_t max_depth = _max_depth.load(std::memory_order_relaxed);
+    const std::uint32_t max_nodes = _max_nodes.load(std::memory_order_relaxed);
+    if((max_depth != 0 && frame._depth > max_depth) || (max_nodes != 0 && tree->size() > max_nodes))
+    {
+        frame._node = tree->findOrAddChild(parent, OverflowSite());
+        frame._overflow = true;
+        return;
+    }
+    frame._node = tree->findOrAddChild(parent, frame._id);
+}
+
+void cag::PerfTimer::AddLeaf(PerfThreadContext* ctx, std::uint32_t id, std::uint64_t weight)
+{
+    PerfTree* const tree = ctx->_tree.load(std::memory_order_relaxed);
+    const PerfScopeFrame* const parent = ctx->_scope_stack.empty() ? nullptr : &ctx->_scope_stack.top();
+
+    // Read the clock last so the bookkeeping above is not measured
+    PerfScopeFrame frame;
+    frame._id = id;
+    frame._weight = weight;
+    frame._depth = parent != nullptr ? parent->_depth + 1 : 1;
+    frame._recursion = 0;
+    frame._max_recursion = 0;
+    frame._folded = false;
+    frame._overflow = false;
+    if(parent != nullptr && (parent->_overflow || (parent->_id == id && parent->_node != nullptr && _recursion_collapse.load(std::memory_order_relaxed))))
+    {
+        // Lands on the parent node, which already times it
+        frame._node = parent->_node;
+        frame._depth = parent->_depth;
+        frame._recursion = parent->_overflow ? 0 : parent->_recursion + 1;
+        frame._folded = true;
+        frame._overflow = parent->_overflow;
+        frame._counted = false;
+        frame._cpu_start = UINT64_MAX;
+        frame._numa = UINT32_MAX;
+    }
+    else
+    {
+        AddChild(tree, parent != nullptr ? parent->_node : &tree->root(), frame);
+        frame._counted = _counters_enabled.load(std::memory_order_relaxed) && ReadCounters(ctx, frame._counters);
+        if(!_cpu_time_enabled.load(std::memory_order_relaxed) || !ReadThreadCpuNanos(frame._cpu_start)) frame._cpu_start = UINT64_MAX;
+        frame._numa = _placement_enabled.load(std::memory_order_relaxed) ? SamplePlacement(ctx) : UINT32_MAX;
+    }
+    frame._ticks = ReadClock();
+    ctx->_scope_stack.push(frame);
+
+    if(_trace_enabled.load(std::memory_order_relaxed)) TraceEvent(ctx, frame._id, frame._ticks, PerfTraceEvent::Begin);
+}
+
+cag::PerfNode::Granularity cag::FindTimeGranularity(std::uint64_t t)
+{
+    if(t / 0x3B9ACA00ULL > 0) return PerfNode::Granularity::S;
+    if(t / 0xF4240ULL > 0)    return PerfNode::Granularity::MS;
+    if(t / 0x3E8ULL > 0)      return PerfNode::Granularity::US;
+    return PerfNode::Granularity::NS;
+}
+
+
+float cag::NanosToValue(PerfNode::Granularity g, std::uint64_t t)
+{
+    switch (g)
+    {
+        case PerfNode::Granularity::NS: return static_cast<float>(t);
+        case PerfNode::Granularity::US: return static_cast<float>(t) / 0x3E8ULL;
+        case PerfNode::Granularity::MS: return static_cast<float>(t) / 0xF4240ULL;
+        case PerfNode::Granularity::S : return static_cast<float>(t) / 0x3B9ACA00ULL;
+    }
+    return 0.0f;
+}
+
+cag::PerfNode::Granularity cag::FindCommonGranularity(PerfNode::Granularity g1, PerfNode::Granularity g2)
+{
+    using UnderlyingType = std::underlying_type<PerfNode::Granularity>::type;
+    PerfNode::Granularity g_common = static_cast<PerfNode::Granularity>(std::max(
+        static_cast<UnderlyingType>(g1), static_cast<UnderlyingType>(g2)
+    ));
+    return g_common;
+}
+
+std::shared_ptr<cag::PerfTimer> cag::PerfTimer::MakePerfTimer(const std::string& name, int line, const std::string& suffix)
+{
+    return std::shared_ptr<PerfTimer>(new PerfTimer(name, line, suffix));
+}
+
+// Placement is that of the thread roots, all the time the thread spent in scopes
+static void PrintThreadHeader(TextBuffer& ss, std::uint64_t tid, std::uint64_t overhead_nanos, const std::vector<std::uint64_t>& numa_hits, const std::vector<std::uint64_t>& numa_nanos)
+{
+    const ThreadIdentity identity = GetThreadIdentity(tid);
+    ss << "[Thread - " << tid;
+    if(!identity._name.empty()) ss << " | " << identity._name;
+    if(identity._os_tid != 0) ss << " | tid " << identity._os_tid;
+    ss << "] (profiler overhead : ";
+    PrintNanos(ss, overhead_nanos);
+    ss << ")";
+    PrintPlacement(ss, numa_hits.data(), numa_nanos.data(), numa_hits.size());
+    ss << "\n";
+}
+
+static void AddPlacement(std::vector<std::uint64_t>& hits, std::vector<std::uint64_t>& nanos, const std::uint64_t* node_hits, const std::uint64_t* node_nanos, std::size_t nodes)
+{
+    if(hits.size() < nodes)
+    {
+        hits.resize(nodes);
+        nanos.resize(nodes);
+    }
+    for(std::size_t i = 0; i < nodes; i++)
+    {
+        hits[i] += node_hits[i];
+        nanos[i] += node_nanos[i];
+    }
+}
+
+static void GetStatisticsFullInternal(TextBuffer& ss, const cag::PerfNode& node)
+{
+    for(int i = 0; i < node._indent; i++) ss << '\t';
+    PrintNode(ss, node);
+    for(const auto& child : node._children)
+    {
+        GetStatisticsFullInternal(ss, child);
+    }
+}
+
+// splitmix64 finalizer, for call path hashes
+static std::uint64_t HashMix(std::uint64_t hash, std::uint64_t value)
+{
+    hash ^= value + 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+// Cheaper per field step for fingerprints, the result goes through HashMix once at the end
+struct Fingerprint
+{
+    std::uint64_t _hash = 0;
+
+    void add(std::uint64_t value)
+    {
+        _hash = ((_hash << 5) | (_hash >> 59)) ^ value;
+        _hash *= 0x100000001b3ULL;
+    }
+
+    void add(float value)
+    {
+        std::uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        add(static_cast<std::uint64_t>(bits));
+    }
+
+    void add(double value)
+    {
+        std::uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        add(bits);
+    }
+};
+
+// Every field a report prints for this node, besides the name which the path already covers
+static std::uint64_t NodeFingerprint(const cag::PerfNode& node)
+{
+    Fingerprint fingerprint;
+    fingerprint.add(static_cast<std::uint64_t>(node._indent) << 32 | static_cast<std::uint64_t>(node._granularity) << 1 | node._children.empty());
+    fingerprint.add(node._value);
+    fingerprint.add(node._pct);
+    fingerprint.add(node._hits);
+    fingerprint.add(node._raw_hits);
+    fingerprint.add(node._self_nanos);
+    fingerprint.add(node._self_pct);
+    if(node._latency._samples > 0)
+    {
+        fingerprint.add(node._latency._min_nanos);
+        fingerprint.add(node._latency._max_nanos);
+        fingerprint.add(node._latency._mean_nanos);
+        fingerprint.add(node._latency._p50_nanos);
+        fingerprint.add(node._latency._p99_nanos);
+        fingerprint.add(node._latency._p999_nanos);
+    }
+    fingerprint.add(node._threads);
+    if(node._threads > 1)
+    {
+        fingerprint.add(node._min_thread_nanos);
+        fingerprint.add(node._max_thread_nanos);
+        fingerprint.add(node._imbalance);
+    }
+    fingerprint.add(node._cpu_nanos);
+    fingerprint.add(node._off_cpu_nanos);
+    fingerprint.add(node._suspended_nanos);
+    if(node._suspended_nanos > 0) fingerprint.add(node._nanos);
+    fingerprint.add(node._max_recursion);
+    for(std::size_t i = 0; i < node._numa_hits.size(); i++)
+    {
+        fingerprint.add(node._numa_hits[i]);
+        fingerprint.add(node._numa_nanos[i]);
+    }
+    fingerprint.add(node._counters._cycles);
+    if(node._counters._cycles > 0)
+    {
+        fingerprint.add(node._counters._instructions);
+        fingerprint.add(node._counters._cache_misses);
+        fingerprint.add(node._counters._branch_misses);
+    }
+    for(const auto& count : node._counts)
+    {
+        fingerprint.add(static_cast<std::uint64_t>(count._id));
+        fingerprint.add(count._value);
+        fingerprint.add(count._rate);
+    }
+    return HashMix(fingerprint._hash, static_cast<std::uint64_t>(node._counts.size()));
+}
+
+// The previous report of a formatter, a node whose printed fields did not change is copied from it
+// instead of formatted again. Lines are matched on the call path, walking the previous report in
+// order so a tree that kept its shape needs no lookup at all
+struct ReportCache
+{
+    struct Line
+    {
+        std::uint64_t _path;
+        std::uint64_t _fingerprint;
+        std::size_t _offset;
+        std::size_t _size;
+    };
+
+    std::mutex _guard;
+    TextBuffer _text;
+    TextBuffer _previous;
+    std::vector<Line> _lines;
+    std::vector<Line> _previous_lines;
+    std::unordered_map<std::uint64_t, std::size_t> _index; // Path to _previous_lines, built on the first miss
+    bool _indexed = false;
+    std::size_t _cursor = 0;
+
+    void begin()
+    {
+        std::swap(_text, _previous);
+        std::swap(_lines, _previous_lines);
+        _text._text.clear();
+        _lines.clear();
+        _index.clear();
+        _indexed = false;
+        _cursor = 0;
+    }
+
+    template<typename Format>
+    void append(std::uint64_t path, std::uint64_t fingerprint, const Format& format)
+    {
+        const Line* previous = nullptr;
+        if(_cursor < _previous_lines.size() && _previous_lines[_cursor]._path == path)
+        {
+            previous = &_previous_lines[_cursor];
+        }
+        else
+        {
+            if(!_indexed)
+            {
+                _index.reserve(_previous_lines.size());
+                for(std::size_t i = 0; i < _previous_lines.size(); i++) _index.emplace(_previous_lines[i]._path, i);
+                _indexed = true;
+            }
+            const auto it = _index.find(path);
+            if(it != _index.end()) previous = &_previous_lines[it->second];
+        }
+
+        const std::size_t offset = _text._text.size();
+        if(previous != nullptr)
+        {
+            _cursor = static_cast<std::size_t>(previous - _previous_lines.data()) + 1;
+            if(previous->_fingerprint == fingerprint) _text._text.append(_previous._text, previous->_offset, previous->_size);
+            else format(_text);
+        }
+        else
+        {
+            format(_text);
+        }
+        _lines.push_back(Line{ path, fingerprint, offset, _text._text.size() - offset });
+    }
+
+    // Both buffers keep their capacity, the next report reuses them
+    std::string finish()
+    {
+        return _text._text;
+    }
+};
+
+static ReportCache tree_string_cache;
+static ReportCache tree_dot_cache;
+
+static void GetStatisticsCached(ReportCache& cache, std::uint64_t path, const cag::PerfNode& node)
+{
+    path = HashMix(path, static_cast<std::uint64_t>(node._id));
+    cache.append(path, NodeFingerprint(node), [&node](TextBuffer& ss) {
+        for(int i = 0; i < node._indent; i++) ss << '\t';
+        PrintNode(ss, node);
+    });
+    for(const auto& child : node._children)
+    {
+        GetStatisticsCached(cache, path, child);
+    }
+}
+
+void cag::PerfTimer::ResetCounters()
+{
+    // Invalidate storage and ptr stack for all threads
+    // Live threads drop their own data lazily when they next record
+    // Dead contexts are freed here, never while a snapshot may be reading them
+    std::lock_guard<std::mutex> snapshot_lock(_snapshot_guard);
+    std::lock_guard<std::mutex> lock(_contexts_guard);
+    _generation.fetch_add(1, std::memory_order_acq_rel);
+
+    for(auto it = _contexts.begin(); it != _contexts.end();)
+    {
+        if(!(*it)->_alive.load()) it = _contexts.erase(it);
+        else it++;
+    }
+
+    // Tasks still running drop what they recorded before this when they fold
+    std::lock_guard<std::mutex> task_lock(_task_guard);
+    _task_tree.assign(1, PerfTaskNode());
+}
+
+
+void cag::PerfTimer::SetClockSource(PerfClockSource source)
+{
+    // Ticks from different sources do not mix
+    InitClock();
+    SelectClock(source);
+    _scope_overhead.store(-1.0);
+    ResetCounters();
+}
+
+double cag::PerfTimer::GetScopeOverhead()
+{
+    const double cached = _scope_overhead.load();
+    if(cached >= 0.0) return cached;
+
+    static const PerfTimer timer("[stperf overhead]", __LINE__);
+    constexpr int iterations = 1000;
+    double overhead = -1.0;
+
+    // Record into a private context so calibration never shows up in the reports
+    InitClock();
+    PerfThreadContext* const previous = _context;
+    for(int run = 0; run < 5; run++)
+    {
+        PerfThreadContext calibration(_generation.load());
+        _context = &calibration;
+
+        timer.start();
+        for(int i = 0; i < iterations; i++)
+        {
+            timer.start();
+            timer.stop();
+        }
+        timer.stop();
+
+        _context = previous;
+
+        // A reset during calibration drops the tree, just try again
+        const PerfTree* const tree = calibration._tree.load();
+        const PerfTreeNode* const outer = tree->firstChild(tree->root());
+        if(outer == nullptr) continue;
+        const PerfTreeNode* const inner = tree->firstChild(*outer);
+        if(inner == nullptr || inner->_hits.load() != iterations || inner->_nanos.load() > outer->_nanos.load()) continue;
+
+        // What the outer scope sees from each inner scope besides its measured body
+        const double run_overhead = static_cast<double>(outer->_nanos.load() - inner->_nanos.load()) / iterations;
+        if(overhead < 0.0 || run_overhead < overhead) overhead = run_overhead;
+    }
+
+    if(overhead < 0.0) overhead = 0.0;
+    _scope_overhead.store(overhead);
+    return overhead;
+}
+
+void cag::PerfTimer::SetOverheadCompensation(bool enable)
+{
+    _overhead_compensation.store(enable);
+}
+
+cag::PerfClockSource cag::PerfTimer::GetClockSource()
+{
+    InitClock();
+    return clock_hardware.load() ? PerfClockSource::Hardware : PerfClockSource::Chrono;
+}
+
+void cag::PerfTimer::SetTraceEnabled(bool enable)
+{
+    _trace_enabled.store(enable);
+}
+
+void cag::PerfTimer::SetHistogramsEnabled(bool enable)
+{
+    // Nodes get their histogram on the next scope exit, earlier exits are not in it
+    _histograms_enabled.store(enable);
+}
+
+bool cag::PerfTimer::SetHardwareCountersEnabled(bool enable)
+{
+    // Probe on the calling thread, other threads open their own group on first use
+    std::uint64_t values[PerfCounters::COUNT];
+    const bool available = !enable || ReadCounters(GetThreadContext(), values);
+    _counters_enabled.store(enable && available);
+    return available;
+}
+
+bool cag::PerfTimer::SetCpuTimeEnabled(bool enable)
+{
+    // One extra clock read per scope boundary, a syscall on some kernels
+    std::uint64_t nanos;
+    const bool available = !enable || ReadThreadCpuNanos(nanos);
+    _cpu_time_enabled.store(enable && available);
+    return available;
+}
+
+bool cag::PerfTimer::SetPlacementEnabled(bool enable)
+{
+    // One getcpu per recorded entry, served by the vDSO without a syscall on Linux
+    const bool available = !enable || ReadCurrentCpu() >= 0;
+    if(enable && available) GetNumaTopology();
+    _placement_enabled.store(enable && available);
+    return available;
+}
+
+void cag::PerfTimer::SetThreadName(const std::string& name)
+{
+    // Register first, a thread registering later would read the OS name over it
+    GetThreadContext();
+    ThreadRegistry& registry = GetThreadRegistry();
+    std::lock_guard<std::mutex> lock(registry._guard);
+    ThreadIdentity& identity = registry._threads[registry.index(std::this_thread::get_id())];
+    identity._name = name;
+    identity._named = true;
+}
+
+std::unordered_map<std::thread::id, cag::PerfThreadInfo> cag::PerfTimer::GetThreadInfo()
+{
+    std::unordered_map<std::thread::id, PerfThreadInfo> output;
+    std::lock_guard<std::mutex> lock(_snapshot_guard);
+    for(PerfThreadContext* ctx : CopyContexts())
+    {
+        // A dead thread whose std::thread::id got reused gives way to the live one
+        const bool alive = ctx->_alive.load();
+        auto it = output.find(ctx->_thread_id);
+        if(it != output.end() && (it->second._alive || !alive)) continue;
+
+        const std::uint64_t tid = GetThreadIdSFF(ctx->_thread_id);
+        const ThreadIdentity identity = GetThreadIdentity(tid);
+        PerfThreadInfo& info = output[ctx->_thread_id];
+        info._thread_id = tid;
+        info._os_tid = identity._os_tid;
+        info._name = identity._name;
+        info._alive = alive;
+        info._last_cpu = ctx->_last_cpu.load(std::memory_order_relaxed);
+        info._last_numa = ctx->_last_numa.load(std::memory_order_relaxed);
+        info._cpu_migrations = ctx->_cpu_migrations.load(std::memory_order_relaxed);
+        info._numa_migrations = ctx->_numa_migrations.load(std::memory_order_relaxed);
+    }
+    return output;
+}
+
+void cag::PerfTimer::SetTreeLimits(std::uint32_t max_depth, std::uint32_t max_nodes)
+{
+    // Checked when a node is added, the nodes already there stay
+    _max_depth.store(max_depth);
+    _max_nodes.store(max_nodes);
+}
+
+void cag::PerfTimer::SetRecursionCollapse(bool enable)
+{
+    _recursion_collapse.store(enable);
+}
+
+void cag::PerfTimer::Count(std::uint32_t id, std::uint64_t value)
+{
+    // Values outside any recorded scope have no node to go to, sampled out scopes drop theirs
+    PerfThreadContext* const ctx = GetThreadContext();
+    if(ctx->_unsampled_depth > 0 || ctx->_scope_stack.empty()) return;
+    const PerfScopeFrame& frame = ctx->_scope_stack.top();
+    if(frame._node == nullptr) return;
+
+    // Few distinct values per node, a list walk is enough
+    PerfCountSlot* slot = frame._node->_counts.load(std::memory_order_relaxed);
+    while(slot != nullptr && slot->_id != id) slot = slot->_next;
+    if(slot == nullptr)
+    {
+        slot = new PerfCountSlot(id, frame._node->_counts.load(std::memory_order_relaxed));
+        frame._node->_counts.store(slot, std::memory_order_release);
+    }
+
+    AddRelaxed(slot->_value, value * frame._weight);
+    AddRelaxed(slot->_samples, frame._weight);
+    if(value < slot->_min.load(std::memory_order_relaxed)) slot->_min.store(value, std::memory_order_relaxed);
+    if(value > slot->_max.load(std::memory_order_relaxed)) slot->_max.store(value, std::memory_order_relaxed);
+}
+
+void cag::PerfTimer::SetTraceBufferSize(std::uint64_t events)
+{
+    // Rounded up to a power of two, each thread picks it up on its next traced scope
+    std::uint64_t capacity = 16;
+    while(capacity < events) capacity <<= 1;
+    _trace_capacity.store(capacity);
+}
+
+void cag::PerfTimer::StopCounters()
+{
+    // Stop all the running counters ordered for all threads
+    // NOTE: Other threads must not be inside a profiled scope while this runs
+    std::lock_guard<std::mutex> lock(_snapshot_guard);
+    for(PerfThreadContext* ctx : CopyContexts())
+    {
+        while(!ctx->_scope_stack.empty()) StopScope(ctx);
+    }
+}
+
+// Newest call paths go first
+static std::vector<const cag::PerfTreeNode*> GetChildrenNewestFirst(const cag::PerfTree& tree, const cag::PerfTreeNode& node)
+{
+    std::vector<const cag::PerfTreeNode*> children;
+    for(const cag::PerfTreeNode* child = tree.firstChild(node); child != nullptr; child = tree.nextSibling(*child))
+    {
+        children.push_back(child);
+    }
+    std::reverse(children.begin(), children.end());
+    return children;
+}
+
+// Value at quantile q of the bucket counts, clamped to what was really observed
+static std::uint64_t HistogramQuantile(const std::vector<std::uint64_t>& counts, std::uint64_t total, double q, std::uint64_t min, std::uint64_t max)
+{
+    const std::uint64_t target = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::ceil(q * static_cast<double>(total))));
+    std::uint64_t cumulative = 0;
+    for(std::uint32_t i = 0; i < counts.size(); i++)
+    {
+        cumulative += counts[i];
+        if(cumulative >= target) return std::min(std::max(cag::PerfHistogram::BucketValue(i), min), max);
+    }
+    return max;
+}
+
+static void CalculateLatency(cag::PerfNode& node)
+{
+    std::uint64_t total = 0;
+    for(const auto count : node._histogram) total += count;
+
+    cag::PerfLatency& latency = node._latency;
+    latency._samples = total;
+    if(total == 0) return;
+
+    latency._mean_nanos = node._raw_hits > 0 ? node._raw_nanos / node._raw_hits : 0;
+    latency._p50_nanos  = HistogramQuantile(node._histogram, total, 0.5, latency._min_nanos, latency._max_nanos);
+    latency._p99_nanos  = HistogramQuantile(node._histogram, total, 0.99, latency._min_nanos, latency._max_nanos);
+    latency._p999_nanos = HistogramQuantile(node._histogram, total, 0.999, latency._min_nanos, latency._max_nanos);
+}
+
+static void CopyRecursion(const cag::PerfTreeNode& src, cag::PerfNode& dst)
+{
+    dst._max_recursion = 0;
+    dst._recursion.clear();
+
+    const cag::PerfRecursionHistogram* const histogram = src._recursion.load(std::memory_order_acquire);
+    if(histogram == nullptr) return;
+
+    // Buckets past the deepest one are always empty
+    dst._max_recursion = histogram->_max_depth.load(std::memory_order_relaxed);
+    const std::uint32_t buckets = std::min(FloorLog2(std::max<std::uint64_t>(dst._max_recursion, 1)) + 1, cag::PerfRecursionHistogram::BUCKETS);
+    dst._recursion.resize(buckets);
+    for(std::uint32_t i = 0; i < buckets; i++) dst._recursion[i] = histogram->_counts[i].load(std::memory_order_relaxed);
+}
+
+static void CopyPlacement(const cag::PerfTreeNode& src, cag::PerfNode& dst)
+{
+    dst._numa_hits.clear();
+    dst._numa_nanos.clear();
+
+    const cag::PerfPlacementCounts* const placement = src._placement.load(std::memory_order_acquire);
+    if(placement == nullptr) return;
+
+    dst._numa_hits.resize(placement->_nodes);
+    dst._numa_nanos.resize(placement->_nodes);
+    for(std::uint32_t i = 0; i < placement->_nodes; i++)
+    {
+        dst._numa_hits[i] = placement->_hits[i].load(std::memory_order_relaxed);
+        dst._numa_nanos[i] = placement->_nanos[i].load(std::memory_order_relaxed);
+    }
+}
+
+static void CopyHistogram(const cag::PerfTreeNode& src, cag::PerfNode& dst)
+{
+    dst._latency = cag::PerfLatency();
+    dst._histogram.clear();
+
+    const cag::PerfHistogram* const histogram = src._histogram.load(std::memory_order_acquire);
+    if(histogram == nullptr) return;
+
+    dst._histogram.resize(cag::PerfHistogram::BUCKETS);
+    for(std::uint32_t i = 0; i < cag::PerfHistogram::BUCKETS; i++)
+    {
+        dst._histogram[i] = histogram->_counts[i].load(std::memory_order_relaxed);
+    }
+    dst._latency._min_nanos = histogram->_min_nanos.load(std::memory_order_relaxed);
+    dst._latency._max_nanos = histogram->_max_nanos.load(std::memory_order_relaxed);
+    CalculateLatency(dst);
+}
+
+// The CPU clock and the wall clock drift a little apart, on CPU time never exceeds the wall time
+static void CalculateOffCpu(cag::PerfNode& node)
+{
+    node._cpu_nanos = std::min(node._cpu_nanos, node._nanos);
+    node._off_cpu_nanos = node._cpu_nanos > 0 ? node._nanos - node._cpu_nanos : 0;
+}
+
+static void CopyCounts(const cag::PerfTreeNode& src, cag::PerfNode& dst)
+{
+    // Slots are pushed at the front, report them in the order they first appeared
+    dst._counts.clear();
+    for(const cag::PerfCountSlot* slot = src._counts.load(std::memory_order_acquire); slot != nullptr; slot = slot->_next)
+    {
+        cag::PerfCount count;
+        count._id = slot->_id;
+        count._value = slot->_value.load(std::memory_order_relaxed);
+        count._samples = slot->_samples.load(std::memory_order_relaxed);
+        count._min = slot->_min.load(std::memory_order_relaxed);
+        count._max = slot->_max.load(std::memory_order_relaxed);
+        count._rate = 0.0;
+        dst._counts.push_back(count);
+    }
+    std::reverse(dst._counts.begin(), dst._counts.end());
+}
+
+// Throughput, needs the node's final time
+static void CalculateCountRates(cag::PerfNode& node)
+{
+    for(auto& count : node._counts)
+    {
+        count._rate = node._nanos > 0 ? static_cast<double>(count._value) * 1.0E9 / static_cast<double>(node._nanos) : 0.0;
+    }
+}
+
+static void MergeCounts(std::vector<cag::PerfCount>& dst, const std::vector<cag::PerfCount>& src)
+{
+    for(const auto& count : src)
+    {
+        auto it = std::find_if(dst.begin(), dst.end(), [&count](const cag::PerfCount& other) { return other._id == count._id; });
+        if(it == dst.end())
+        {
+            dst.push_back(count);
+            continue;
+        }
+        it->_value += count._value;
+        it->_samples += count._samples;
+        it->_min = std::min(it->_min, count._min);
+        it->_max = std::max(it->_max, count._max);
+    }
+}
+
+// Exclusive time, needs the children's final inclusive time
+static void CalculateSelfTime(cag::PerfNode& node)
+{
+    std::uint64_t children_nanos = 0;
+    for(const auto& child : node._children) children_nanos += child._nanos;
+    node._self_nanos = node._nanos - std::min(node._nanos, children_nanos);
+}
+
+static float CalculateSelfPct(const cag::PerfNode& root, const cag::PerfNode& node)
+{
+    return root._nanos > 0 ? static_cast<float>(static_cast<double>(node._self_nanos) / static_cast<double>(root._nanos)) : 0.0f;
+}
+
+struct SubtreeHits
+{
+    std::uint64_t _raw;
+    std::uint64_t _extrapolated;
+};
+
+// Returns the number of scope exits recorded in this subtree
+static SubtreeHits BuildPerfNode(const cag::PerfTree& tree, const cag::PerfTreeNode& src, cag::PerfNode& dst, int indent, double overhead, bool compensate)
+{
+    dst._id = src._id;
+    dst._indent = indent;
+    dst._hits = src._hits.load(std::memory_order_relaxed);
+    dst._nanos = src._nanos.load(std::memory_order_relaxed);
+    dst._raw_hits = src._raw_hits.load(std::memory_order_relaxed);
+    dst._raw_nanos = src._raw_nanos.load(std::memory_order_relaxed);
+    dst._pct = 0.0f;
+    dst._counters._cycles        = src._counters[0].load(std::memory_order_relaxed);
+    dst._counters._instructions  = src._counters[1].load(std::memory_order_relaxed);
+    dst._counters._cache_misses  = src._counters[2].load(std::memory_order_relaxed);
+    dst._counters._branch_misses = src._counters[3].load(std::memory_order_relaxed);
+    dst._cpu_nanos = src._cpu_nanos.load(std::memory_order_relaxed);
+    CopyHistogram(src, dst);
+    CopyCounts(src, dst);
+    CopyRecursion(src, dst);
+    CopyPlacement(src, dst);
+
+    const auto children = GetChildrenNewestFirst(tree, src);
+
+    // Folded entries ran inside the outer one, their cost is in our time like that of a child
+    const std::uint64_t folded_hits = src._folded_hits.load(std::memory_order_relaxed);
+    SubtreeHits descendant_hits = { folded_hits, folded_hits };
+    dst._children.resize(children.size());
+    for(std::size_t i = 0; i < children.size(); i++)
+    {
+        const SubtreeHits child_hits = BuildPerfNode(tree, *children[i], dst._children[i], indent + 1, overhead, compensate);
+        descendant_hits._raw += child_hits._raw;
+        descendant_hits._extrapolated += child_hits._extrapolated;
+    }
+
+    // Every scope below us inflated our time by the cost of its enter/exit
+    dst._overhead_nanos = static_cast<std::uint64_t>(static_cast<double>(descendant_hits._raw) * overhead);
+    if(compensate)
+    {
+        const std::uint64_t extrapolated_overhead = static_cast<std::uint64_t>(static_cast<double>(descendant_hits._extrapolated) * overhead);
+        dst._raw_nanos -= std::min(dst._raw_nanos, dst._overhead_nanos);
+        dst._nanos -= std::min(dst._nanos, extrapolated_overhead);
+    }
+
+    CalculateSelfTime(dst);
+    CalculateOffCpu(dst);
+    CalculateCountRates(dst);
+    dst._threads = 1;
+    dst._min_thread_nanos = dst._nanos;
+    dst._max_thread_nanos = dst._nanos;
+    dst._imbalance = 0.0f;
+
+    dst._granularity = cag::FindTimeGranularity(dst._nanos);
+    dst._value = cag::NanosToValue(dst._granularity, dst._nanos);
+    return { descendant_hits._raw - folded_hits + dst._raw_hits, descendant_hits._extrapolated - folded_hits + dst._hits };
+}
+
+static float CalculateRootRelativePct(const cag::PerfNode& root, const cag::PerfNode& node)
+{
+    auto granularity = cag::FindCommonGranularity(node._granularity, root._granularity);
+    return cag::NanosToValue(granularity, node._nanos) / cag::NanosToValue(granularity, root._nanos);
+    // return static_cast<float>(node._nanos) / root._nanos;
+}
+
+static void CalculateTreeRelativePct(cag::PerfNode& root, std::vector<cag::PerfNode>& children)
+{
+    for(auto& child : children)
+    {
+        child._pct = CalculateRootRelativePct(root, child);
+        child._self_pct = CalculateSelfPct(root, child);
+        CalculateTreeRelativePct(root, child._children);
+    }
+}
+
+// Must run under _snapshot_guard, which serializes snapshots
+static const cag::PerfTree* AcquireThreadTree(cag::PerfThreadContext& ctx)
+{
+    // Trees retired before this snapshot started can no longer be in use
+    std::lock_guard<std::mutex> lock(ctx._retired_guard);
+    ctx._retired.clear();
+    return ctx._tree.load(std::memory_order_acquire);
+}
+
+static std::vector<cag::PerfNode> BuildThreadTree(const cag::PerfTree& tree, double overhead, bool compensate)
+{
+    const auto roots = GetChildrenNewestFirst(tree, tree.root());
+    std::vector<cag::PerfNode> thread_tree(roots.size());
+    for(std::size_t i = 0; i < roots.size(); i++)
+    {
+        cag::PerfNode& root = thread_tree[i];
+        BuildPerfNode(tree, *roots[i], root, 0, overhead, compensate);
+        root._pct = CalculateRootRelativePct(root, root);
+        root._self_pct = CalculateSelfPct(root, root);
+        CalculateTreeRelativePct(root, root._children);
+    }
+    return thread_tree;
+}
+
+// Below this many nodes spawning workers costs more than the conversion itself
+static constexpr std::uint64_t PARALLEL_BUILD_NODES = 4096;
+
+// Runs task(0..count-1) spread over the available cores
+static void ParallelFor(std::size_t count, std::uint64_t work, const std::function<void(std::size_t)>& task)
+{
+    const std::size_t cores = std::max(1U, std::thread::hardware_concurrency());
+    const std::size_t workers = std::min(cores, count);
+    if(workers <= 1 || work < PARALLEL_BUILD_NODES)
+    {
+        for(std::size_t i = 0; i < count; i++) task(i);
+        return;
+    }
+
+    // Threads differ a lot in tree size, hand out one at a time
+    std::atomic<std::size_t> next(0);
+    auto worker = [&]() {
+        for(std::size_t i = next++; i < count; i = next++) task(i);
+    };
+
+    std::vector<std::future<void>> pending;
+    pending.reserve(workers - 1);
+    for(std::size_t i = 1; i < workers; i++) pending.push_back(std::async(std::launch::async, worker));
+    worker();
+    for(auto& f : pending) f.get();
+}
+
+// Folds src into dst, both being the same call path
+static void MergePerfNode(cag::PerfNode& dst, const cag::PerfNode& src)
+{
+    dst._nanos += src._nanos;
+    dst._hits += src._hits;
+    dst._raw_nanos += src._raw_nanos;
+    dst._raw_hits += src._raw_hits;
+    dst._overhead_nanos += src._overhead_nanos;
+    dst._threads += src._threads;
+    dst._min_thread_nanos = std::min(dst._min_thread_nanos, src._min_thread_nanos);
+    dst._max_thread_nanos = std::max(dst._max_thread_nanos, src._max_thread_nanos);
+    dst._counters._cycles        += src._counters._cycles;
+    dst._counters._instructions  += src._counters._instructions;
+    dst._counters._cache_misses  += src._counters._cache_misses;
+    dst._counters._branch_misses += src._counters._branch_misses;
+    dst._cpu_nanos += src._cpu_nanos;
+    MergeCounts(dst._counts, src._counts);
+    dst._max_recursion = std::max(dst._max_recursion, src._max_recursion);
+    if(dst._recursion.size() < src._recursion.size()) dst._recursion.resize(src._recursion.size());
+    for(std::size_t i = 0; i < src._recursion.size(); i++) dst._recursion[i] += src._recursion[i];
+    if(dst._numa_hits.size() < src._numa_hits.size())
+    {
+        dst._numa_hits.resize(src._numa_hits.size());
+        dst._numa_nanos.resize(src._numa_nanos.size());
+    }
+    for(std::size_t i = 0; i < src._numa_hits.size(); i++)
+    {
+        dst._numa_hits[i] += src._numa_hits[i];
+        dst._numa_nanos[i] += src._numa_nanos[i];
+    }
+
+    if(!src._histogram.empty())
+    {
+        if(dst._histogram.empty())
+        {
+            dst._histogram = src._histogram;
+            dst._latency = src._latency;
+        }
+        else
+        {
+            for(std::size_t i = 0; i < dst._histogram.size(); i++) dst._histogram[i] += src._histogram[i];
+            dst._latency._min_nanos = std::min(dst._latency._min_nanos, src._latency._min_nanos);
+            dst._latency._max_nanos = std::max(dst._latency._max_nanos, src._latency._max_nanos);
+        }
+    }
+
+    // Same site under the same parent is the same call path, first seen goes first
+    std::unordered_map<std::uint32_t, std::size_t> index;
+    for(std::size_t i = 0; i < dst._children.size(); i++) index.emplace(dst._children[i]._id, i);
+    for(const auto& child : src._children)
+    {
+        auto it = index.find(child._id);
+        if(it == index.end())
+        {
+            index.emplace(child._id, dst._children.size());
+            dst._children.push_back(child);
+        }
+        else MergePerfNode(dst._children[it->second], child);
+    }
+}
+
+static void FinishMergedNode(cag::PerfNode& node)
+{
+    const double mean = static_cast<double>(node._nanos) / static_cast<double>(node._threads);
+    node._imbalance = mean > 0.0 ? static_cast<float>(static_cast<double>(node._max_thread_nanos) / mean - 1.0) : 0.0f;
+    node._granularity = cag::FindTimeGranularity(node._nanos);
+    node._value = cag::NanosToValue(node._granularity, node._nanos);
+    CalculateLatency(node);
+    CalculateSelfTime(node);
+    CalculateOffCpu(node);
+    CalculateCountRates(node);
+    for(auto& child : node._children) FinishMergedNode(child);
+}
+
+// Drops what merging threads computes, both trees ran on the same thread id
+static void ResetThreadSpread(cag::PerfNode& node)
+{
+    node._threads = 1;
+    node._min_thread_nanos = node._nanos;
+    node._max_thread_nanos = node._nanos;
+    for(auto& child : node._children) ResetThreadSpread(child);
+}
+
+// Threads that get the std::thread::id of an exited one report under the same key, fold them together
+static void AddThreadTree(std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& output, const std::thread::id& id, std::vector<cag::PerfNode>&& roots)
+{
+    auto it = output.find(id);
+    if(it == output.end())
+    {
+        output.emplace(id, std::move(roots));
+        return;
+    }
+
+    cag::PerfNode merged = cag::PerfNode();
+    merged._children = std::move(it->second);
+    cag::PerfNode thread_node = cag::PerfNode();
+    thread_node._children = std::move(roots);
+    MergePerfNode(merged, thread_node);
+
+    for(auto& root : merged._children)
+    {
+        ResetThreadSpread(root);
+        FinishMergedNode(root);
+        root._pct = CalculateRootRelativePct(root, root);
+        root._self_pct = CalculateSelfPct(root, root);
+        CalculateTreeRelativePct(root, root._children);
+    }
+    it->second = std::move(merged._children);
+}
+
+std::unordered_map<std::thread::id, std::vector<cag::PerfNode>> cag::PerfTimer::GetCallTree()
+{
+    using RType = std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>;
+    RType output;
+
+    const double overhead = GetScopeOverhead();
+    const bool compensate = _overhead_compensation.load();
+
+    // Threads registering meanwhile only wait for the context list copy, not for the build
+    std::lock_guard<std::mutex> lock(_snapshot_guard);
+    const std::uint64_t generation = _generation.load(std::memory_order_acquire);
+
+    std::vector<std::pair<std::thread::id, const PerfTree*>> trees;
+    std::uint64_t nodes = 0;
+    for(PerfThreadContext* ctx : CopyContexts())
+    {
+        // Skip threads that did not record anything since the last reset
+        if(ctx->_generation.load(std::memory_order_acquire) != generation) continue;
+        const PerfTree* const tree = AcquireThreadTree(*ctx);
+        if(tree->firstChild(tree->root()) == nullptr) continue;
+        trees.emplace_back(ctx->_thread_id, tree);
+        nodes += tree->size();
+    }
+
+    // The tree is aggregated while recording, so there is nothing to collapse here
+    // Owners keep recording while we read, counters are only loaded never locked
+    // Holding _snapshot_guard keeps every tree alive until all workers are done
+    std::vector<std::vector<PerfNode>> thread_trees(trees.size());
+    ParallelFor(trees.size(), nodes, [&](std::size_t i) {
+        thread_trees[i] = BuildThreadTree(*trees[i].second, overhead, compensate);
+    });
+
+    for(std::size_t i = 0; i < trees.size(); i++) AddThreadTree(output, trees[i].first, std::move(thread_trees[i]));
+    return output;
+}
+
+struct TraceRecord
+{
+    std::uint64_t _ticks;
+    std::uint32_t _id;
+    std::uint32_t _kind;
+};
+
+static std::vector<TraceRecord> CopyTrace(const cag::PerfTraceRing& trace, std::uint64_t window_start, std::uint64_t now)
+{
+    const std::uint64_t capacity = trace._capacity;
+    const std::uint64_t head = trace._head.load(std::memory_order_acquire);
+    const std::uint64_t first = std::max(trace._floor.load(std::memory_order_acquire), head > capacity ? head - capacity : 0);
+
+    std::vector<TraceRecord> records;
+    records.reserve(head - first);
+    for(std::uint64_t i = first; i < head; i++)
+    {
+        const cag::PerfTraceEvent& event = trace._events[i & (capacity - 1)];
+        records.push_back({ 
+            event._ticks.load(std::memory_order_relaxed),
+            event._id.load(std::memory_order_relaxed),
+            event._kind.load(std::memory_order_relaxed)
+        });
+    }
+
+    // Drop whatever the owner overwrote while we were copying
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const std::uint64_t claimed = trace._claimed.load(std::memory_order_relaxed);
+    const std::uint64_t valid_first = claimed > capacity ? claimed - capacity : 0;
+    if(valid_first > first) records.erase(records.begin(), records.begin() + std::min<std::uint64_t>(valid_first - first, records.size()));
+
+    // Keep only the requested window
+    std::vector<TraceRecord> window;
+    window.reserve(records.size());
+    for(const auto& record : records)
+    {
+        if(record._ticks >= window_start && record._ticks <= now) window.push_back(record);
+    }
+    return window;
+}
+
+// Scopes already running when the window starts begin at its start, those still running end at now
+// Every end of the result matches the last open begin
+static std::vector<TraceRecord> BalanceTrace(const std::vector<TraceRecord>& records, std::uint64_t window_start, std::uint64_t now)
+{
+    // Ends without a begin belong to scopes already running when the window starts (innermost first)
+    std::vector<std::uint32_t> open_at_start;
+    std::size_t depth = 0;
+    for(const auto& record : records)
+    {
+        if(record._kind == cag::PerfTraceEvent::Begin) depth++;
+        else if(depth > 0) depth--;
+        else open_at_start.push_back(record._id);
+    }
+
+    std::vector<TraceRecord> balanced;
+    std::vector<std::uint32_t> open(open_at_start.rbegin(), open_at_start.rend());
+    balanced.reserve(records.size() + open.size() + depth);
+    for(const auto id : open) balanced.push_back({ window_start, id, cag::PerfTraceEvent::Begin });
+
+    for(const auto& record : records)
+    {
+        balanced.push_back(record);
+        if(record._kind == cag::PerfTraceEvent::Begin) open.push_back(record._id);
+        else open.pop_back();
+    }
+
+    while(!open.empty())
+    {
+        balanced.push_back({ now, open.back(), cag::PerfTraceEvent::End });
+        open.pop_back();
+    }
+    return balanced;
+}
+
+static void ReplayTrace(const std::vector<TraceRecord>& balanced, bool histogram, cag::PerfTree& tree)
+{
+    struct ReplayFrame { cag::PerfTreeNode* _node; std::uint64_t _ticks; };
+    std::vector<ReplayFrame> stack;
+    for(const auto& record : balanced)
+    {
+        if(record._kind == cag::PerfTraceEvent::Begin)
+        {
+            cag::PerfTreeNode* const parent = stack.empty() ? &tree.root() : stack.back()._node;
+            stack.push_back({ tree.findOrAddChild(parent, record._id), record._ticks });
+        }
+        else
+        {
+            const ReplayFrame& frame = stack.back();
+            if(frame._node != nullptr) RecordScope(frame._node, TicksToNanos(record._ticks - frame._ticks), 1, histogram);
+            stack.pop_back();
+        }
+    }
+}
+
+static void GetTraceWindow(double seconds, std::uint64_t& window_start, std::uint64_t& now)
+{
+    InitClock();
+    now = ReadClock();
+    const std::uint64_t window = NanosToTicks(static_cast<std::uint64_t>(std::max(seconds, 0.0) * 1.0E9));
+    window_start = now > window ? now - window : 0;
+}
+
+std::unordered_map<std::thread::id, std::vector<cag::PerfNode>> cag::PerfTimer::GetTraceCallTree(double seconds)
+{
+    using RType = std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>;
+    RType output;
+
+    const double overhead = GetScopeOverhead();
+    const bool compensate = _overhead_compensation.load();
+    const bool histogram = _histograms_enabled.load();
+
+    std::uint64_t window_start, now;
+    GetTraceWindow(seconds, window_start, now);
+
+    std::lock_guard<std::mutex> lock(_snapshot_guard);
+    const std::uint64_t generation = _generation.load(std::memory_order_acquire);
+
+    std::vector<std::pair<std::thread::id, const PerfTraceRing*>> traces;
+    std::uint64_t events = 0;
+    for(PerfThreadContext* ctx : CopyContexts())
+    {
+        if(ctx->_generation.load(std::memory_order_acquire) != generation) continue;
+        const PerfTraceRing* const trace = ctx->_trace.load(std::memory_order_acquire);
+        if(trace == nullptr) continue;
+        traces.emplace_back(ctx->_thread_id, trace);
+        events += trace->_capacity;
+    }
+
+    // Rings are owned by their context, which _snapshot_guard keeps alive
+    std::vector<std::vector<PerfNode>> thread_trees(traces.size());
+    ParallelFor(traces.size(), events, [&](std::size_t i) {
+        PerfTree thread_tree;
+        ReplayTrace(BalanceTrace(CopyTrace(*traces[i].second, window_start, now), window_start, now), histogram, thread_tree);
+        if(thread_tree.firstChild(thread_tree.root()) == nullptr) return;
+        thread_trees[i] = BuildThreadTree(thread_tree, overhead, compensate);
+    });
+
+    for(std::size_t i = 0; i < traces.size(); i++)
+    {
+        if(!thread_trees[i].empty()) AddThreadTree(output, traces[i].first, std::move(thread_trees[i]));
+    }
+    return output;
+}
+
+static void WriteJsonString(std::ostream& out, const std::string& value)
+{
+    out << '"';
+    for(const char c : value)
+    {
+        switch(c)
+        {
+            case '"':  out << "\\\""; break;
+            case '\\': out << "\\\\"; break;
+            case '\n': out << "\\n"; break;
+            case '\t': out << "\\t"; break;
+            default:
+                if(static_cast<unsigned char>(c) < 0x20) out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+                else out << c;
+        }
+    }
+    out << '"';
+}
+
+void cag::PerfTimer::WriteChromeTrace(std::ostream& out, double seconds)
+{
+    std::uint64_t window_start, now;
+    GetTraceWindow(seconds, window_start, now);
+
+    // Copy the rings under the lock, format without it
+    std::vector<std::pair<std::uint64_t, std::vector<TraceRecord>>> threads;
+    {
+        std::lock_guard<std::mutex> lock(_snapshot_guard);
+        const std::uint64_t generation = _generation.load(std::memory_order_acquire);
+        for(PerfThreadContext* ctx : CopyContexts())
+        {
+            if(ctx->_generation.load(std::memory_order_acquire) != generation) continue;
+            const PerfTraceRing* const trace = ctx->_trace.load(std::memory_order_acquire);
+            if(trace == nullptr) continue;
+            threads.emplace_back(GetThreadIdSFF(ctx->_thread_id), BalanceTrace(CopyTrace(*trace, window_start, now), window_start, now));
+        }
+    }
+
+#if defined(_WIN32)
+    const int pid = _getpid();
+#else
+    const int pid = static_cast<int>(getpid());
+#endif
+
+    // Chrome trace_event format, timestamps in us from the window start
+    std::unordered_map<std::uint32_t, std::string> names;
+    const auto flags = out.flags();
+    const auto precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for(const auto& thread : threads)
+    {
+        if(thread.second.empty()) continue;
+        if(!first) out << ",";
+        first = false;
+        out << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << thread.first;
+        const ThreadIdentity identity = GetThreadIdentity(thread.first);
+        out << ",\"args\":{\"name\":";
+        WriteJsonString(out, identity._name.empty() ? "Thread - " + std::to_string(thread.first) : identity._name);
+        out << "}}";
+
+        for(const auto& record : thread.second)
+        {
+            auto name = names.find(record._id);
+            if(name == names.end()) name = names.emplace(record._id, GetSite(record._id)._name).first;
+
+            out << ",\n{\"name\":";
+            WriteJsonString(out, name->second);
+            out << ",\"ph\":\"" << (record._kind == PerfTraceEvent::Begin ? 'B' : 'E') << "\",\"pid\":" << pid << ",\"tid\":" << thread.first;
+            out << ",\"ts\":" << static_cast<double>(TicksToNanos(record._ticks - window_start)) / 1.0E3 << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+std::string cag::PerfTimer::GetChromeTrace(double seconds)
+{
+    std::stringstream ss;
+    WriteChromeTrace(ss, seconds);
+    return ss.str();
+}
+
+// Inclusive time only counts the outermost entry of a site on each path, recursion would count it twice
+static void CollectHotspots(const cag::PerfNode& node, std::unordered_map<std::uint32_t, std::size_t>& index,
+                            std::unordered_map<std::uint32_t, int>& active, std::uint32_t thread,
+                            std::vector<std::pair<cag::PerfHotspot, std::uint32_t>>& hotspots)
+{
+    auto it = index.find(node._id);
+    if(it == index.end())
+    {
+        it = index.emplace(node._id, hotspots.size()).first;
+        hotspots.push_back({ cag::PerfHotspot(), thread });
+        hotspots.back().first._id = node._id;
+        hotspots.back().first._threads = 1;
+    }
+
+    auto& hotspot = hotspots[it->second];
+    if(hotspot.second != thread)
+    {
+        hotspot.second = thread;
+        hotspot.first._threads++;
+    }
+    hotspot.first._self_nanos += node._self_nanos;
+    hotspot.first._hits += node._hits;
+
+    int& depth = active[node._id];
+    if(depth++ == 0) hotspot.first._nanos += node._nanos;
+    for(const auto& child : node._children) CollectHotspots(child, index, active, thread, hotspots);
+    depth--;
+}
+
+std::vector<cag::PerfHotspot> cag::PerfTimer::GetTopSelfTime(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree, std::size_t count)
+{
+    // Flat per site view across every path and thread, like a sampling profiler would rank it
+    std::unordered_map<std::uint32_t, std::size_t> index;
+    std::unordered_map<std::uint32_t, int> active;
+    std::vector<std::pair<PerfHotspot, std::uint32_t>> hotspots;
+    std::uint64_t total_nanos = 0;
+    std::uint32_t thread = 0;
+    for(const auto& thread_root : tree)
+    {
+        thread++;
+        for(const auto& root : thread_root.second)
+        {
+            total_nanos += root._nanos;
+            CollectHotspots(root, index, active, thread, hotspots);
+        }
+    }
+
+    std::vector<PerfHotspot> output;
+    output.reserve(hotspots.size());
+    for(auto& hotspot : hotspots)
+    {
+        hotspot.first._self_pct = total_nanos > 0 ? static_cast<float>(static_cast<double>(hotspot.first._self_nanos) / static_cast<double>(total_nanos)) : 0.0f;
+        output.push_back(hotspot.first);
+    }
+
+    const std::size_t top = std::min(count, output.size());
+    std::partial_sort(output.begin(), output.begin() + top, output.end(), [](const PerfHotspot& a, const PerfHotspot& b) {
+        return a._self_nanos > b._self_nanos;
+    });
+    output.resize(top);
+    return output;
+}
+
+std::string cag::PerfTimer::GetTopSelfTimeString(const std::vector<PerfHotspot>& hotspots)
+{
+    TextBuffer ss;
+    for(std::size_t i = 0; i < hotspots.size(); i++)
+    {
+        const PerfHotspot& hotspot = hotspots[i];
+        ss << "#" << i + 1 << " [" << GetSite(hotspot._id)._name << " | x" << hotspot._hits;
+        if(hotspot._threads > 1) ss << " | " << hotspot._threads << " threads";
+        ss << "] Self time : ";
+        PrintNanos(ss, hotspot._self_nanos);
+        ss << " (";
+        ss.number(100 * hotspot._self_pct, 4, 3) << "%). Total time : ";
+        PrintNanos(ss, hotspot._nanos);
+        ss << ".\n";
+    }
+    return ss._text;
+}
+
+// Overhead of every scope in a tree, the roots included
+static std::uint64_t TreeOverhead(const std::vector<cag::PerfNode>& roots, double overhead)
+{
+    std::uint64_t tree_overhead = 0;
+    for(const auto& node : roots)
+    {
+        tree_overhead += node._overhead_nanos + static_cast<std::uint64_t>(static_cast<double>(node._raw_hits) * overhead);
+    }
+    return tree_overhead;
+}
+
+std::string cag::PerfTimer::GetCallTreeString(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree)
+{
+    // Concurrent callers format from scratch rather than wait on the cache
+    std::unique_lock<std::mutex> lock(tree_string_cache._guard, std::try_to_lock);
+    ReportCache uncached;
+    ReportCache& cache = lock.owns_lock() ? tree_string_cache : uncached;
+    cache.begin();
+
+    const double overhead = GetScopeOverhead();
+    for(const auto& thread_root : tree)
+    {
+        const std::uint64_t tid = GetThreadIdSFF(thread_root.first);
+        std::vector<std::uint64_t> numa_hits, numa_nanos;
+        for(const auto& node : thread_root.second) AddPlacement(numa_hits, numa_nanos, node._numa_hits.data(), node._numa_nanos.data(), node._numa_hits.size());
+        PrintThreadHeader(cache._text, tid, TreeOverhead(thread_root.second, overhead), numa_hits, numa_nanos);
+
+        for(const auto& node : thread_root.second)
+        { 
+            GetStatisticsCached(cache, HashMix(0, tid), node);
+        }
+    }
+    return cache.finish();
+}
+
+std::vector<cag::PerfNode> cag::PerfTimer::GetMergedCallTree(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree)
+{
+    // Roots merge like children of an implicit node above all threads
+    PerfNode merged = PerfNode();
+    for(const auto& thread_root : tree)
+    {
+        PerfNode thread_node = PerfNode();
+        thread_node._children = thread_root.second;
+        MergePerfNode(merged, thread_node);
+    }
+
+    for(auto& root : merged._children)
+    {
+        FinishMergedNode(root);
+        root._pct = CalculateRootRelativePct(root, root);
+        root._self_pct = CalculateSelfPct(root, root);
+        CalculateTreeRelativePct(root, root._children);
+    }
+    return merged._children;
+}
+
+std::vector<cag::PerfNode> cag::PerfTimer::GetMergedCallTree()
+{
+    return GetMergedCallTree(GetCallTree());
+}
+
+std::string cag::PerfTimer::GetMergedCallTreeString(const std::vector<PerfNode>& tree)
+{
+    TextBuffer ss;
+    ss << "[Merged] (profiler overhead : ";
+    PrintNanos(ss, TreeOverhead(tree, GetScopeOverhead()));
+    ss << ")\n";
+
+    for(const auto& node : tree)
+    {
+        GetStatisticsFullInternal(ss, node);
+    }
+    return ss._text;
+}
+
+// =================================
+// Tasks
+// =================================
+// Same site under the same parent is the same call path, children keep their first seen order
+static std::uint32_t FindOrAddTaskChild(std::vector<cag::PerfTaskNode>& nodes, std::uint32_t parent, std::uint32_t id)
+{
+    std::uint32_t last = 0;
+    for(std::uint32_t child = nodes[parent]._first_child; child != 0; child = nodes[child]._next_sibling)
+    {
+        if(nodes[child]._id == id) return child;
+        last = child;
+    }
+
+    const std::uint32_t index = static_cast<std::uint32_t>(nodes.size());
+    nodes.push_back(cag::PerfTaskNode());
+    nodes[index]._id = id;
+    if(last == 0) nodes[parent]._first_child = index;
+    else nodes[last]._next_sibling = index;
+    return index;
+}
+
+static void MergeTaskNodes(const std::vector<cag::PerfTaskNode>& src, std::uint32_t src_parent, std::vector<cag::PerfTaskNode>& dst, std::uint32_t dst_parent)
+{
+    for(std::uint32_t child = src[src_parent]._first_child; child != 0; child = src[child]._next_sibling)
+    {
+        const std::uint32_t index = FindOrAddTaskChild(dst, dst_parent, src[child]._id);
+        dst[index]._nanos += src[child]._nanos;
+        dst[index]._suspended_nanos += src[child]._suspended_nanos;
+        dst[index]._hits += src[child]._hits;
+        MergeTaskNodes(src, child, dst, index);
+    }
+}
+
+cag::PerfTask::PerfTask() : _nodes(1), _suspended_ticks(0), _suspend_start(0), _generation(0), _suspended(false)
+{
+    InitClock();
+}
+
+cag::PerfTask::~PerfTask()
+{
+    // Scopes left open (a destroyed coroutine) end here
+    while(!_frames.empty()) exit();
+}
+
+std::uint64_t cag::PerfTask::suspendedTicks(std::uint64_t now) const
+{
+    return _suspended_ticks + (_suspended ? now - _suspend_start : 0);
+}
+
+void cag::PerfTask::enter(std::uint32_t id)
+{
+    if(_frames.empty()) _generation = PerfTimer::_generation.load(std::memory_order_acquire);
+
+    // Nothing below an unknown site is recorded either
+    const std::uint32_t parent = _frames.empty() ? 0 : _frames.back()._node;
+    PerfTaskFrame frame;
+    frame._node = parent != UINT32_MAX && PerfTimer::FindSite(id) != nullptr ? FindOrAddTaskChild(_nodes, parent, id) : UINT32_MAX;
+
+    // Read the clock last so the bookkeeping above is not measured
+    frame._ticks = ReadClock();
+    frame._suspended_ticks = suspendedTicks(frame._ticks);
+    _frames.push_back(frame);
+}
+
+void cag::PerfTask::exit()
+{
+    if(_frames.empty()) return;
+
+    const std::uint64_t now = ReadClockEnd();
+    const PerfTaskFrame frame = _frames.back();
+    _frames.pop_back();
+    if(frame._node != UINT32_MAX)
+    {
+        // Time suspended since the entry is known from the task total alone, no matter how many hops
+        PerfTaskNode& node = _nodes[frame._node];
+        const std::uint64_t nanos = TicksToNanos(now - frame._ticks);
+        node._nanos += nanos;
+        node._suspended_nanos += std::min(nanos, TicksToNanos(suspendedTicks(now) - frame._suspended_ticks));
+        node._hits++;
+    }
+    if(!_frames.empty()) return;
+
+    // Outermost scope done, publish it unless a reset happened meanwhile
+    {
+        std::lock_guard<std::mutex> lock(PerfTimer::_task_guard);
+        if(_generation == PerfTimer::_generation.load(std::memory_order_acquire)) MergeTaskNodes(_nodes, 0, PerfTimer::_task_tree, 0);
+    }
+    _nodes.assign(1, PerfTaskNode());
+}
+
+void cag::PerfTask::suspend()
+{
+    if(_suspended) return;
+    _suspend_start = ReadClock();
+    _suspended = true;
+}
+
+void cag::PerfTask::resume()
+{
+    if(!_suspended) return;
+    _suspended_ticks += ReadClock() - _suspend_start;
+    _suspended = false;
+}
+
+static void BuildTaskNode(const std::vector<cag::PerfTaskNode>& nodes, std::uint32_t index, cag::PerfNode& dst, int indent)
+{
+    const cag::PerfTaskNode& src = nodes[index];
+    dst._id = src._id;
+    dst._indent = indent;
+    dst._nanos = src._nanos;
+    dst._hits = src._hits;
+    dst._raw_nanos = src._nanos;
+    dst._raw_hits = src._hits;
+    dst._suspended_nanos = src._suspended_nanos;
+    dst._threads = 1;
+    dst._min_thread_nanos = dst._nanos;
+    dst._max_thread_nanos = dst._nanos;
+    dst._granularity = cag::FindTimeGranularity(dst._nanos);
+    dst._value = cag::NanosToValue(dst._granularity, dst._nanos);
+
+    for(std::uint32_t child = src._first_child; child != 0; child = nodes[child]._next_sibling)
+    {
+        dst._children.push_back(cag::PerfNode());
+        BuildTaskNode(nodes, child, dst._children.back(), indent + 1);
+    }
+    CalculateSelfTime(dst);
+}
+
+std::vector<cag::PerfNode> cag::PerfTimer::GetTaskCallTree()
+{
+    // Tasks only publish finished outermost scopes, copy and build outside the lock
+    std::vector<PerfTaskNode> nodes;
+    {
+        std::lock_guard<std::mutex> lock(_task_guard);
+        nodes = _task_tree;
+    }
+
+    std::vector<PerfNode> output;
+    for(std::uint32_t child = nodes[0]._first_child; child != 0; child = nodes[child]._next_sibling)
+    {
+        output.push_back(PerfNode());
+        PerfNode& root = output.back();
+        BuildTaskNode(nodes, child, root, 0);
+        root._pct = root._nanos > 0 ? 1.0f : 0.0f;
+        root._self_pct = CalculateSelfPct(root, root);
+        if(root._nanos > 0) CalculateTreeRelativePct(root, root._children);
+    }
+    return output;
+}
+
+std::string cag::PerfTimer::GetTaskCallTreeString(const std::vector<PerfNode>& tree)
+{
+    TextBuffer ss;
+    ss << "[Tasks]\n";
+    for(const auto& node : tree)
+    {
+        GetStatisticsFullInternal(ss, node);
+    }
+    return ss._text;
+}
+
+// Frames are split on ';' and the value on the last space, keep names from breaking that
+static void AppendFoldedFrame(std::string& path, const std::string& name)
+{
+    for(const char c : name) path += (c == ';' || c == '\n' || c == '\r') ? '_' : c;
+}
+
+static void GenFoldedNode(const cag::PerfNode& node, std::string& path, std::string& output)
+{
+    const std::size_t parent_size = path.size();
+    path += ';';
+    AppendFoldedFrame(path, node.name());
+
+    // What the children do goes to their own lines
+    if(node._self_nanos > 0)
+    {
+        output += path;
+        output += ' ';
+        output += std::to_string(node._self_nanos);
+        output += '\n';
+    }
+
+    for(const auto& child : node._children) GenFoldedNode(child, path, output);
+    path.resize(parent_size);
+}
+
+std::string cag::PerfTimer::GetCallTreeFolded(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree)
+{
+    // One line per call path with self nanos, threads are the bottom frame
+    std::string output;
+    std::string path;
+    for(const auto& thread_root : tree)
+    {
+        const std::string thread_frame = "Thread - " + std::to_string(GetThreadIdSFF(thread_root.first));
+        for(const auto& node : thread_root.second)
+        {
+            path = thread_frame;
+            GenFoldedNode(node, path, output);
+        }
+    }
+    return output;
+}
+
+static std::string GenDotHeader()
+{
+    return "digraph stperf_info {\nnode[shape=box];\n"; 
+}
+
+static std::string GenDotFooter()
+{
+    return "}";
+}
+
+// TODO: (César) : Switch to graphviz html tags
+static void GenNodeData(TextBuffer& ss, const cag::PerfNode& node)
+{
+    ss << " [";
+
+    // Label
+    ss << "label=\"{ { " << node.name() << " | {" << node._hits << " hit" << ((node._hits > 1) ? "s" : "");
+    if(node._raw_hits != node._hits) ss << " (sampled x" << node._raw_hits << ")";
+    ss << " | " << node._value << TimeSuffix(node._granularity) << "} | ";
+    ss.number(node._pct * 100, 4, 3) << "%";
+    if(node._latency._samples > 0)
+    {
+        ss << " | {p50 ";   PrintNanos(ss, node._latency._p50_nanos);
+        ss << " | p99 ";    PrintNanos(ss, node._latency._p99_nanos);
+        ss << " | p99.9 ";  PrintNanos(ss, node._latency._p999_nanos);
+        ss << " | max ";    PrintNanos(ss, node._latency._max_nanos);
+        ss << "}";
+    }
+    if(node._cpu_nanos > 0)
+    {
+        ss << " | {on CPU ";  PrintNanos(ss, node._cpu_nanos);
+        ss << " | off CPU "; PrintNanos(ss, node._off_cpu_nanos);
+        ss << "}";
+    }
+    if(node._max_recursion > 0) ss << " | {max depth " << node._max_recursion << "}";
+    if(!node._numa_hits.empty())
+    {
+        ss << " | {";
+        for(std::size_t i = 0; i < node._numa_hits.size(); i++)
+        {
+            if(i > 0) ss << " | ";
+            ss << "numa " << i << " x" << node._numa_hits[i] << " ";
+            PrintNanos(ss, node._numa_nanos[i]);
+        }
+        ss << "}";
+    }
+    for(const auto& count : node._counts)
+    {
+        ss << " | {" << count.name() << " " << count._value << " | ";
+        ss.number(count._rate, 4) << "/s}";
+    }
+    if(node._counters._cycles > 0)
+    {
+        const double kilo_instructions = static_cast<double>(node._counters._instructions) / 1000.0;
+        ss << " | {IPC ";
+        ss.number(static_cast<double>(node._counters._instructions) / static_cast<double>(node._counters._cycles), 3);
+        ss << " | LLC MPKI ";
+        ss.number(kilo_instructions > 0.0 ? static_cast<double>(node._counters._cache_misses) / kilo_instructions : 0.0, 3);
+        ss << " | branch MPKI ";
+        ss.number(kilo_instructions > 0.0 ? static_cast<double>(node._counters._branch_misses) / kilo_instructions : 0.0, 3);
+        ss << "}";
+    }
+    ss << " } }\"";
+
+    // Color
+    ss << "style=filled fillcolor=white";
+
+    ss << "];";
+}
+
+static void GenDotNode(ReportCache& cache, std::uint64_t path, const cag::PerfNode& node)
+{
+    cache.append(path, NodeFingerprint(node), [&node](TextBuffer& ss) { GenNodeData(ss, node); });
+}
+
+static void GenDotChildSection(const std::vector<cag::PerfNode>& nodes, size_t& i, ReportCache& cache, std::uint64_t parent_path, const std::string& parent)
+{
+    TextBuffer& ss = cache._text;
+    for(const auto& node : nodes)
+    {
+        const std::string dot_name = "Node" + std::to_string(i++);
+        const std::uint64_t path = HashMix(parent_path, static_cast<std::uint64_t>(node._id));
+        
+        // Generate self
+        ss << dot_name;
+        GenDotNode(cache, path, node);
+        ss << "\n" << parent << " -> " << dot_name << ";\n";
+        
+        // Generate children
+        if(!node._children.empty())
+        {
+            GenDotChildSection(node._children, i, cache, path, dot_name);
+        }
+    }
+}
+
+static void GenDotThreadSection(ReportCache& cache, const std::vector<cag::PerfNode>& root, const std::uint64_t tid)
+{
+    TextBuffer& ss = cache._text;
+    ss << "subgraph cluster_stperf_info_thread_" << tid << "{\n";
+    ss << "node [shape=record];\n";
+    ss << "style=filled;\n";
+    ss << "color=black;\n";
+    ss << "fillcolor=lightgrey;\n";
+    
+    size_t i = 0;
+    for(const auto& node : root)
+    {
+        const std::string dot_name = "Node" + std::to_string(i++);
+        const std::uint64_t path = HashMix(HashMix(0, tid), static_cast<std::uint64_t>(node._id));
 
         if(!node._children.empty())
         {
-            GenDotChildSection(node._children, i, ss, dot_name);
+            GenDotChildSection(node._children, i, cache, path, dot_name);
         }
 
-        ss << dot_name << GenNodeData(node) << "\n";
+        ss << dot_name;
+        GenDotNode(cache, path, node);
+        ss << "\n";
     }
 
-    ss << "label = \"Thread #" + std::to_string(tid) + "\";\n";
+    const ThreadIdentity identity = GetThreadIdentity(tid);
+    ss << "label = \"Thread #" << tid;
+    if(!identity._name.empty()) ss << " " << identity._name;
+    if(identity._os_tid != 0) ss << " (tid " << identity._os_tid << ")";
+    ss << "\";\n";
     ss << "labeljust = \"l\"\n";
     ss << "}\n";
-    return ss.str();
 }
 
-std::string cag::PerfTimer::GetCallTreeDot(const std::unordered_map<std::thread::id, std::vector<PerfNode>> &tree)
+std::string cag::PerfTimer::GetCallTreeDot(const std::unordered_map<std::thread::id, std::vector<PerfNode>> &tree)
+{
+    std::unique_lock<std::mutex> lock(tree_dot_cache._guard, std::try_to_lock);
+    ReportCache uncached;
+    ReportCache& cache = lock.owns_lock() ? tree_dot_cache : uncached;
+    cache.begin();
+
+    cache._text << GenDotHeader();
+    
+    for(const auto& thread_root : tree)
+    {
+        GenDotThreadSection(cache, thread_root.second, GetThreadIdSFF(thread_root.first));
+    }
+
+    cache._text << GenDotFooter();
+    return cache.finish();
+}
+
+// =================================
+// Binary dump
+// =================================
+// The layout is the file format, it must not change without a version bump
+static_assert(sizeof(stperf_DumpHeader) == 48, "stperf_DumpHeader layout changed");
+static_assert(sizeof(stperf_DumpThread) == 24, "stperf_DumpThread layout changed");
+static_assert(sizeof(stperf_DumpNode) == 112, "stperf_DumpNode layout changed");
+
+static const char dump_magic[8] = { 'S', 'T', 'P', 'E', 'R', 'F', '\0', '\0' };
+
+static std::uint64_t AlignDump(std::uint64_t size)
+{
+    return (size + 7) & ~7ULL;
+}
+
+static void FlattenDumpNodes(const cag::PerfNode& node, std::uint32_t parent, std::uint32_t depth,
+                             std::unordered_map<std::uint32_t, std::uint32_t>& names, std::string& strings,
+                             std::vector<stperf_DumpNode>& output)
+{
+    // Each site name is stored once per dump
+    auto name = names.find(node._id);
+    if(name == names.end())
+    {
+        name = names.emplace(node._id, static_cast<std::uint32_t>(strings.size())).first;
+        strings += node.name();
+        strings += '\0';
+    }
+
+    stperf_DumpNode dump_node;
+    memset(&dump_node, 0, sizeof(dump_node));
+    dump_node._nanos = node._nanos;
+    dump_node._hits = node._hits;
+    dump_node._raw_nanos = node._raw_nanos;
+    dump_node._raw_hits = node._raw_hits;
+    dump_node._overhead_nanos = node._overhead_nanos;
+    dump_node._latency._samples    = node._latency._samples;
+    dump_node._latency._min_nanos  = node._latency._min_nanos;
+    dump_node._latency._max_nanos  = node._latency._max_nanos;
+    dump_node._latency._mean_nanos = node._latency._mean_nanos;
+    dump_node._latency._p50_nanos  = node._latency._p50_nanos;
+    dump_node._latency._p99_nanos  = node._latency._p99_nanos;
+    dump_node._latency._p999_nanos = node._latency._p999_nanos;
+    dump_node._parent = parent;
+    dump_node._name = name->second;
+    dump_node._line = cag::PerfTimer::GetSite(node._id)._line;
+    dump_node._depth = depth;
+
+    const std::uint32_t index = static_cast<std::uint32_t>(output.size());
+    output.push_back(dump_node);
+    for(const auto& child : node._children) FlattenDumpNodes(child, index, depth + 1, names, strings, output);
+}
+
+static bool WriteAll(int fd, const void* data, std::uint64_t size)
+{
+    // Usually a single call, loop in case the kernel takes less
+    const char* bytes = static_cast<const char*>(data);
+    while(size > 0)
+    {
+#if defined(_WIN32)
+        const int written = _write(fd, bytes, static_cast<unsigned int>(std::min<std::uint64_t>(size, 1U << 30)));
+#else
+        const ssize_t written = write(fd, bytes, static_cast<std::size_t>(size));
+#endif
+        if(written <= 0) return false;
+        bytes += written;
+        size -= static_cast<std::uint64_t>(written);
+    }
+    return true;
+}
+
+bool cag::PerfTimer::WriteCallTreeDump(const std::string& path, const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree)
+{
+    // Everything is laid out in memory first so each section is written at once
+    std::unordered_map<std::uint32_t, std::uint32_t> names;
+    std::string strings;
+    std::vector<std::vector<stperf_DumpNode>> thread_nodes;
+    std::vector<stperf_DumpThread> threads;
+    thread_nodes.reserve(tree.size());
+    threads.reserve(tree.size());
+
+    std::uint64_t offset = AlignDump(sizeof(stperf_DumpHeader) + tree.size() * sizeof(stperf_DumpThread));
+    for(const auto& thread_root : tree)
+    {
+        thread_nodes.emplace_back();
+        for(const auto& root : thread_root.second) FlattenDumpNodes(root, STPERF_DUMP_NO_PARENT, 0, names, strings, thread_nodes.back());
+        threads.push_back({ GetThreadIdSFF(thread_root.first), offset, thread_nodes.back().size() });
+        offset += thread_nodes.back().size() * sizeof(stperf_DumpNode);
+    }
+    strings.resize(AlignDump(strings.size()), '\0');
+
+    std::vector<char> head(AlignDump(sizeof(stperf_DumpHeader) + threads.size() * sizeof(stperf_DumpThread)), '\0');
+    stperf_DumpHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header._magic, dump_magic, sizeof(dump_magic));
+    header._version = STPERF_DUMP_VERSION;
+    header._endian = STPERF_DUMP_ENDIAN;
+    header._thread_count = threads.size();
+    header._strings_offset = offset;
+    header._strings_size = strings.size();
+    header._file_size = offset + strings.size();
+    memcpy(head.data(), &header, sizeof(header));
+    if(!threads.empty()) memcpy(head.data() + sizeof(header), threads.data(), threads.size() * sizeof(stperf_DumpThread));
+
+#if defined(_WIN32)
+    const int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if(fd < 0) return false;
+
+    bool ok = WriteAll(fd, head.data(), head.size());
+    for(const auto& nodes : thread_nodes)
+    {
+        if(ok && !nodes.empty()) ok = WriteAll(fd, nodes.data(), nodes.size() * sizeof(stperf_DumpNode));
+    }
+    if(ok) ok = WriteAll(fd, strings.data(), strings.size());
+
+#if defined(_WIN32)
+    ok = (_close(fd) == 0) && ok;
+#else
+    ok = (close(fd) == 0) && ok;
+#endif
+    return ok;
+}
+
+// Only checks the sections, node contents are trusted
+static bool ValidateDump(const void* base, std::uint64_t size, stperf_DumpView* view)
+{
+    if(size < sizeof(stperf_DumpHeader)) return false;
+    const stperf_DumpHeader* const header = static_cast<const stperf_DumpHeader*>(base);
+    if(memcmp(header->_magic, dump_magic, sizeof(dump_magic)) != 0) return false;
+    if(header->_version != STPERF_DUMP_VERSION || header->_endian != STPERF_DUMP_ENDIAN) return false;
+    if(header->_file_size != size) return false;
+    if(header->_thread_count > (size - sizeof(stperf_DumpHeader)) / sizeof(stperf_DumpThread)) return false;
+    if(header->_strings_offset > size || header->_strings_size > size - header->_strings_offset) return false;
+
+    const stperf_DumpThread* const threads = reinterpret_cast<const stperf_DumpThread*>(header + 1);
+    for(std::uint64_t i = 0; i < header->_thread_count; i++)
+    {
+        if(threads[i]._nodes_offset > size) return false;
+        if(threads[i]._node_count > (size - threads[i]._nodes_offset) / sizeof(stperf_DumpNode)) return false;
+    }
+
+    view->_header = header;
+    view->_threads = threads;
+    view->_strings = static_cast<const char*>(base) + header->_strings_offset;
+    view->_base = base;
+    view->_size = size;
+    return true;
+}
+
+// =================================
+// Diff
+// =================================
+// One side of a comparison, threads merged and paths keyed by name so runs of different processes line up
+struct DiffInput
+{
+    std::string _name;
+    std::uint64_t _nanos;
+    std::uint64_t _hits;
+    std::vector<DiffInput> _children;
+    std::unordered_map<std::string, std::size_t> _index; // Of _children by name
+};
+
+static DiffInput& FindOrAddDiffInput(DiffInput& parent, const std::string& name)
+{
+    auto it = parent._index.find(name);
+    if(it == parent._index.end())
+    {
+        it = parent._index.emplace(name, parent._children.size()).first;
+        parent._children.push_back(DiffInput{ name, 0, 0, {}, {} });
+    }
+    return parent._children[it->second];
+}
+
+static void AddDiffInput(DiffInput& parent, const cag::PerfNode& node)
+{
+    DiffInput& input = FindOrAddDiffInput(parent, node.name());
+    input._nanos += node._nanos;
+    input._hits += node._hits;
+    for(const auto& child : node._children) AddDiffInput(input, child);
+}
+
+static DiffInput BuildDiffInput(const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& tree)
+{
+    DiffInput root = { "", 0, 0, {}, {} };
+    for(const auto& thread_root : tree)
+    {
+        for(const auto& node : thread_root.second) AddDiffInput(root, node);
+    }
+    return root;
+}
+
+static bool BuildDiffInput(const std::string& path, DiffInput& root)
+{
+    stperf_DumpView view;
+    if(stperf_OpenDump(path.c_str(), &view) != 0) return false;
+
+    // Dump nodes are trusted by the reader, check the links before following them
+    bool ok = true;
+    root = DiffInput{ "", 0, 0, {}, {} };
+    for(std::uint64_t t = 0; ok && t < view._header->_thread_count; t++)
+    {
+        const stperf_DumpNode* const nodes = stperf_GetDumpNodes(&view, t);
+        const std::uint64_t count = view._threads[t]._node_count;
+
+        // Ancestors of the current node, a parent anywhere else means a broken preorder
+        std::vector<std::pair<std::uint64_t, DiffInput*>> ancestors;
+        for(std::uint64_t i = 0; i < count; i++)
+        {
+            const stperf_DumpNode& node = nodes[i];
+            while(!ancestors.empty() && ancestors.back().first != node._parent) ancestors.pop_back();
+            const bool root_node = node._parent == STPERF_DUMP_NO_PARENT;
+            if((!root_node && ancestors.empty()) || node._name >= view._header->_strings_size)
+            {
+                ok = false;
+                break;
+            }
+            const char* const name = view._strings + node._name;
+            const std::string name_s(name, strnlen(name, static_cast<std::size_t>(view._header->_strings_size - node._name)));
+
+            DiffInput& input = FindOrAddDiffInput(root_node ? root : *ancestors.back().second, name_s);
+            input._nanos += node._nanos;
+            input._hits += node._hits;
+            ancestors.push_back({ i, &input });
+        }
+    }
+    stperf_CloseDump(&view);
+    return ok;
+}
+
+static std::uint64_t DiffSelfNanos(const DiffInput* input)
+{
+    if(input == nullptr) return 0;
+    std::uint64_t children_nanos = 0;
+    for(const auto& child : input->_children) children_nanos += child._nanos;
+    return input->_nanos - std::min(input->_nanos, children_nanos);
+}
+
+static void DiffChildren(const DiffInput* before, const DiffInput* after, int indent, std::vector<cag::PerfDiffNode>& output);
+
+static cag::PerfDiffNode DiffNode(const std::string& name, const DiffInput* before, const DiffInput* after, int indent)
+{
+    cag::PerfDiffNode node;
+    node._name = name;
+    node._indent = indent;
+    node._before_nanos = before != nullptr ? before->_nanos : 0;
+    node._after_nanos = after != nullptr ? after->_nanos : 0;
+    node._before_self_nanos = DiffSelfNanos(before);
+    node._after_self_nanos = DiffSelfNanos(after);
+    node._before_hits = before != nullptr ? before->_hits : 0;
+    node._after_hits = after != nullptr ? after->_hits : 0;
+    node._delta_nanos = static_cast<std::int64_t>(node._after_nanos) - static_cast<std::int64_t>(node._before_nanos);
+    node._delta_hits = static_cast<std::int64_t>(node._after_hits) - static_cast<std::int64_t>(node._before_hits);
+    if(node._before_nanos > 0) node._change = static_cast<double>(node._delta_nanos) / static_cast<double>(node._before_nanos);
+    else node._change = node._after_nanos > 0 ? std::numeric_limits<double>::infinity() : 0.0;
+    DiffChildren(before, after, indent + 1, node._children);
+    return node;
+}
+
+static void DiffChildren(const DiffInput* before, const DiffInput* after, int indent, std::vector<cag::PerfDiffNode>& output)
+{
+    // Paths of both sides, those only in one of them diff against nothing
+    if(after != nullptr)
+    {
+        for(const auto& child : after->_children)
+        {
+            const DiffInput* previous = nullptr;
+            if(before != nullptr)
+            {
+                const auto it = before->_index.find(child._name);
+                if(it != before->_index.end()) previous = &before->_children[it->second];
+            }
+            output.push_back(DiffNode(child._name, previous, &child, indent));
+        }
+    }
+    if(before != nullptr)
+    {
+        for(const auto& child : before->_children)
+        {
+            if(after == nullptr || after->_index.find(child._name) == after->_index.end()) output.push_back(DiffNode(child._name, &child, nullptr, indent));
+        }
+    }
+
+    // Biggest regression first, improvements last
+    std::stable_sort(output.begin(), output.end(), [](const cag::PerfDiffNode& a, const cag::PerfDiffNode& b) {
+        return a._delta_nanos > b._delta_nanos;
+    });
+}
+
+std::vector<cag::PerfDiffNode> cag::PerfTimer::GetCallTreeDiff(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& before,
+                                                               const std::unordered_map<std::thread::id, std::vector<PerfNode>>& after)
+{
+    const DiffInput before_input = BuildDiffInput(before);
+    const DiffInput after_input = BuildDiffInput(after);
+    std::vector<PerfDiffNode> output;
+    DiffChildren(&before_input, &after_input, 0, output);
+    return output;
+}
+
+bool cag::PerfTimer::GetCallTreeDiff(const std::string& before_dump, const std::string& after_dump, std::vector<PerfDiffNode>& diff)
+{
+    DiffInput before_input;
+    DiffInput after_input;
+    if(!BuildDiffInput(before_dump, before_input) || !BuildDiffInput(after_dump, after_input)) return false;
+    diff.clear();
+    DiffChildren(&before_input, &after_input, 0, diff);
+    return true;
+}
+
+static void PrintSignedNanos(TextBuffer& ss, std::int64_t nanos)
+{
+    ss << (nanos < 0 ? "-" : "+");
+    PrintNanos(ss, nanos < 0 ? 0 - static_cast<std::uint64_t>(nanos) : static_cast<std::uint64_t>(nanos));
+}
+
+static void PrintChange(TextBuffer& ss, double change)
+{
+    if(std::isinf(change))
+    {
+        ss << "new";
+        return;
+    }
+    if(change >= 0.0) ss << '+';
+    ss.number(100 * change, 4) << "%";
+}
+
+static void GenDiffString(TextBuffer& ss, const cag::PerfDiffNode& node)
+{
+    for(int i = 0; i < node._indent; i++) ss << '\t';
+    ss << "-> [" << node._name << "] Time : ";
+    PrintNanos(ss, node._before_nanos);
+    ss << " -> ";
+    PrintNanos(ss, node._after_nanos);
+    ss << " (";
+    PrintSignedNanos(ss, node._delta_nanos);
+    ss << ", ";
+    PrintChange(ss, node._change);
+    ss << "). Hits : " << node._before_hits << " -> " << node._after_hits << " (" << (node._delta_hits >= 0 ? "+" : "") << node._delta_hits << ").\n";
+    for(const auto& child : node._children) GenDiffString(ss, child);
+}
+
+std::string cag::PerfTimer::GetCallTreeDiffString(const std::vector<PerfDiffNode>& diff)
+{
+    std::uint64_t before_nanos = 0;
+    std::uint64_t after_nanos = 0;
+    for(const auto& node : diff)
+    {
+        before_nanos += node._before_nanos;
+        after_nanos += node._after_nanos;
+    }
+
+    TextBuffer ss;
+    ss << "[Diff] (before : ";
+    PrintNanos(ss, before_nanos);
+    ss << " | after : ";
+    PrintNanos(ss, after_nanos);
+    ss << ")\n";
+    for(const auto& node : diff) GenDiffString(ss, node);
+    return ss._text;
+}
+
+// Red for regressions and green for improvements, full strength from a 100% change
+static void GenDiffColor(TextBuffer& ss, double change)
+{
+    const double strength = std::min(1.0, std::fabs(std::isinf(change) ? 1.0 : change));
+    const unsigned shade = 255U - static_cast<unsigned>(strength * 175.0);
+    char color[8];
+    if(change > 0.0) snprintf(color, sizeof(color), "#ff%02x%02x", shade, shade);
+    else snprintf(color, sizeof(color), "#%02xff%02x", shade, shade);
+    ss << "style=filled fillcolor=\"" << color << "\"";
+}
+
+static void GenDiffDotSection(const std::vector<cag::PerfDiffNode>& nodes, std::size_t& i, TextBuffer& ss, const std::string& parent)
+{
+    for(const auto& node : nodes)
+    {
+        const std::string dot_name = "Node" + std::to_string(i++);
+        ss << dot_name << " [label=\"{ { " << node._name << " | {";
+        PrintNanos(ss, node._before_nanos);
+        ss << " | ";
+        PrintNanos(ss, node._after_nanos);
+        ss << "} | {";
+        PrintSignedNanos(ss, node._delta_nanos);
+        ss << " | ";
+        PrintChange(ss, node._change);
+        ss << "} | {" << node._before_hits << " hits | " << node._after_hits << " hits} } }\"";
+        GenDiffColor(ss, node._change);
+        ss << "];\n";
+        if(!parent.empty()) ss << parent << " -> " << dot_name << ";\n";
+        GenDiffDotSection(node._children, i, ss, dot_name);
+    }
+}
+
+std::string cag::PerfTimer::GetCallTreeDiffDot(const std::vector<PerfDiffNode>& diff)
+{
+    TextBuffer ss;
+    ss << GenDotHeader() << "node [shape=record];\n";
+    std::size_t i = 0;
+    GenDiffDotSection(diff, i, ss, "");
+    ss << GenDotFooter();
+    return ss._text;
+}
+
+static void GenDiffFolded(const cag::PerfDiffNode& node, std::string& path, std::string& output)
+{
+    const std::size_t parent_size = path.size();
+    if(!path.empty()) path += ';';
+    AppendFoldedFrame(path, node._name);
+
+    // difffolded.pl layout, flamegraph.pl --negate and friends take it as is
+    if(node._before_self_nanos > 0 || node._after_self_nanos > 0)
+    {
+        output += path;
+        output += ' ';
+        output += std::to_string(node._before_self_nanos);
+        output += ' ';
+        output += std::to_string(node._after_self_nanos);
+        output += '\n';
+    }
+
+    for(const auto& child : node._children) GenDiffFolded(child, path, output);
+    path.resize(parent_size);
+}
+
+std::string cag::PerfTimer::GetCallTreeDiffFolded(const std::vector<PerfDiffNode>& diff)
+{
+    std::string output;
+    std::string path;
+    for(const auto& node : diff) GenDiffFolded(node, path, output);
+    return output;
+}
+
+// =================================
+// Reporter
+// =================================
+// Bucket midpoints are all a delta histogram can tell about its extremes
+static void CalculateDeltaLatency(cag::PerfNode& node)
+{
+    node._latency = cag::PerfLatency();
+    std::uint32_t first = cag::PerfHistogram::BUCKETS, last = 0;
+    for(std::uint32_t i = 0; i < node._histogram.size(); i++)
+    {
+        if(node._histogram[i] == 0) continue;
+        first = std::min(first, i);
+        last = i;
+    }
+    if(first == cag::PerfHistogram::BUCKETS) return;
+
+    node._latency._min_nanos = cag::PerfHistogram::BucketValue(first);
+    node._latency._max_nanos = cag::PerfHistogram::BucketValue(last);
+    CalculateLatency(node);
+}
+
+// Returns false when nothing happened on this path during the interval
+static bool DiffPerfNode(const cag::PerfNode& current, const cag::PerfNode* previous, cag::PerfNode& delta)
+{
+    // Counters going back means the tree was reset in between, start over from zero
+    if(previous != nullptr && (previous->_raw_hits > current._raw_hits || previous->_hits > current._hits ||
+                               previous->_nanos > current._nanos || previous->_raw_nanos > current._raw_nanos))
+    {
+        previous = nullptr;
+    }
+
+    delta._id = current._id;
+    delta._indent = current._indent;
+    delta._pct = 0.0f;
+    delta._hits = current._hits - (previous != nullptr ? previous->_hits : 0);
+    delta._nanos = current._nanos - (previous != nullptr ? previous->_nanos : 0);
+    delta._raw_hits = current._raw_hits - (previous != nullptr ? previous->_raw_hits : 0);
+    delta._raw_nanos = current._raw_nanos - (previous != nullptr ? previous->_raw_nanos : 0);
+    delta._overhead_nanos = current._overhead_nanos - std::min(current._overhead_nanos, previous != nullptr ? previous->_overhead_nanos : 0);
+    delta._threads = 1;
+    delta._min_thread_nanos = delta._nanos;
+    delta._max_thread_nanos = delta._nanos;
+    delta._imbalance = 0.0f;
+    delta._granularity = cag::FindTimeGranularity(delta._nanos);
+    delta._value = cag::NanosToValue(delta._granularity, delta._nanos);
+    delta._counters = current._counters;
+    if(previous != nullptr)
+    {
+        delta._counters._cycles        -= std::min(delta._counters._cycles, previous->_counters._cycles);
+        delta._counters._instructions  -= std::min(delta._counters._instructions, previous->_counters._instructions);
+        delta._counters._cache_misses  -= std::min(delta._counters._cache_misses, previous->_counters._cache_misses);
+        delta._counters._branch_misses -= std::min(delta._counters._branch_misses, previous->_counters._branch_misses);
+    }
+    delta._cpu_nanos = current._cpu_nanos - std::min(current._cpu_nanos, previous != nullptr ? previous->_cpu_nanos : 0);
+    CalculateOffCpu(delta);
+
+    // Extremes cannot be diffed, they stay those of the whole run
+    delta._counts.clear();
+    for(const auto& count : current._counts)
+    {
+        cag::PerfCount count_delta = count;
+        if(previous != nullptr)
+        {
+            for(const auto& before : previous->_counts)
+            {
+                if(before._id != count._id) continue;
+                count_delta._value -= std::min(count_delta._value, before._value);
+                count_delta._samples -= std::min(count_delta._samples, before._samples);
+            }
+        }
+        if(count_delta._samples > 0) delta._counts.push_back(count_delta);
+    }
+    CalculateCountRates(delta);
+
+    delta._histogram = current._histogram;
+    if(previous != nullptr && previous->_histogram.size() == delta._histogram.size())
+    {
+        for(std::size_t i = 0; i < delta._histogram.size(); i++) delta._histogram[i] -= std::min(delta._histogram[i], previous->_histogram[i]);
+    }
+    CalculateDeltaLatency(delta);
+
+    // Like latency extremes the deepest recursion stays that of the whole run
+    delta._max_recursion = current._max_recursion;
+    delta._recursion = current._recursion;
+    if(previous != nullptr)
+    {
+        for(std::size_t i = 0; i < std::min(delta._recursion.size(), previous->_recursion.size()); i++) delta._recursion[i] -= std::min(delta._recursion[i], previous->_recursion[i]);
+    }
+    delta._numa_hits = current._numa_hits;
+    delta._numa_nanos = current._numa_nanos;
+    if(previous != nullptr)
+    {
+        for(std::size_t i = 0; i < std::min(delta._numa_hits.size(), previous->_numa_hits.size()); i++)
+        {
+            delta._numa_hits[i] -= std::min(delta._numa_hits[i], previous->_numa_hits[i]);
+            delta._numa_nanos[i] -= std::min(delta._numa_nanos[i], previous->_numa_nanos[i]);
+        }
+    }
+
+    std::unordered_map<std::uint32_t, const cag::PerfNode*> previous_children;
+    if(previous != nullptr)
+    {
+        for(const auto& child : previous->_children) previous_children.emplace(child._id, &child);
+    }
+
+    // Scopes still running show up through their children only
+    delta._children.clear();
+    delta._children.reserve(current._children.size());
+    for(const auto& child : current._children)
+    {
+        const auto it = previous_children.find(child._id);
+        delta._children.emplace_back();
+        if(!DiffPerfNode(child, it != previous_children.end() ? it->second : nullptr, delta._children.back())) delta._children.pop_back();
+    }
+    CalculateSelfTime(delta);
+    return delta._raw_hits > 0 || !delta._children.empty();
+}
+
+static void CalculateDeltaPct(const cag::PerfNode& root, std::vector<cag::PerfNode>& children)
+{
+    for(auto& child : children)
+    {
+        child._pct = root._nanos > 0 ? CalculateRootRelativePct(root, child) : 0.0f;
+        child._self_pct = CalculateSelfPct(root, child);
+        CalculateDeltaPct(root, child._children);
+    }
+}
+
+std::unordered_map<std::thread::id, std::vector<cag::PerfNode>> cag::PerfTimer::GetCallTreeDelta(
+    const std::unordered_map<std::thread::id, std::vector<PerfNode>>& current,
+    const std::unordered_map<std::thread::id, std::vector<PerfNode>>& previous)
+{
+    std::unordered_map<std::thread::id, std::vector<PerfNode>> output;
+    for(const auto& thread_root : current)
+    {
+        const auto previous_thread = previous.find(thread_root.first);
+
+        // The roots diff like the children of an implicit node above them
+        PerfNode current_root = PerfNode();
+        PerfNode previous_root = PerfNode();
+        PerfNode delta_root = PerfNode();
+        current_root._children = thread_root.second;
+        if(previous_thread != previous.end()) previous_root._children = previous_thread->second;
+
+        if(!DiffPerfNode(current_root, &previous_root, delta_root)) continue;
+        for(auto& root : delta_root._children)
+        {
+            root._pct = root._nanos > 0 ? 1.0f : 0.0f;
+            root._self_pct = CalculateSelfPct(root, root);
+            CalculateDeltaPct(root, root._children);
+        }
+        output.emplace(thread_root.first, std::move(delta_root._children));
+    }
+    return output;
+}
+
+struct PerfReporter
+{
+    std::mutex _guard;            // Serializes start/stop
+    std::mutex _wake_guard;
+    std::condition_variable _wake;
+    bool _stop = false;
+    std::thread _thread;
+
+    ~PerfReporter() { stop(); }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(_guard);
+        if(!_thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> wake_lock(_wake_guard);
+            _stop = true;
+        }
+        _wake.notify_all();
+        _thread.join();
+    }
+};
+
+static PerfReporter reporter;
+
+bool cag::PerfTimer::StartReporter(std::chrono::milliseconds interval, PerfReportSink sink)
+{
+    if(!sink || interval.count() <= 0) return false;
+
+    std::lock_guard<std::mutex> lock(reporter._guard);
+    if(reporter._thread.joinable()) return false;
+    reporter._stop = false;
+
+    // Only snapshots are taken, recording threads never wait on the reporter
+    // The first interval starts now, not when the thread gets scheduled
+    auto baseline = std::make_shared<std::unordered_map<std::thread::id, std::vector<PerfNode>>>(GetCallTree());
+    reporter._thread = std::thread([interval, sink, baseline]() {
+        auto previous = std::move(*baseline);
+        bool stop = false;
+        while(!stop)
+        {
+            {
+                std::unique_lock<std::mutex> wake_lock(reporter._wake_guard);
+                stop = reporter._wake.wait_for(wake_lock, interval, []() { return reporter._stop; });
+            }
+
+            // Stopping still reports what happened since the last interval
+            auto current = GetCallTree();
+            sink(GetCallTreeDelta(current, previous));
+            previous = std::move(current);
+        }
+    });
+    return true;
+}
+
+void cag::PerfTimer::StopReporter()
+{
+    reporter.stop();
+}
+
+cag::PerfReportSink cag::PerfTimer::MakeFileReportSink(const std::string& path)
+{
+    auto file = std::make_shared<std::ofstream>(path, std::ios::out | std::ios::app);
+    if(!*file) return PerfReportSink();
+
+    return [file](const std::unordered_map<std::thread::id, std::vector<PerfNode>>& delta) {
+        const auto now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch());
+        *file << "[Report - " << now.count() << "ms]" << std::endl;
+        *file << GetCallTreeString(delta);
+        file->flush();
+    };
+}
+
+// Metric names are dot separated paths, keep them to what statsd accepts
+static std::string StatsdName(const std::string& name)
+{
+    std::string output;
+    output.reserve(name.size());
+    for(const char c : name) output += (std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '-') ? c : '_';
+    return output;
+}
+
+static void StatsdLines(const cag::PerfNode& node, const std::string& parent, std::vector<std::string>& lines)
+{
+    const std::string path = parent + "." + StatsdName(node.name());
+    if(node._hits > 0)
+    {
+        lines.push_back(path + ".hits:" + std::to_string(node._hits) + "|c");
+        lines.push_back(path + ".nanos:" + std::to_string(node._nanos) + "|c");
+    }
+    for(const auto& child : node._children) StatsdLines(child, path, lines);
+}
+
+cag::PerfReportSink cag::PerfTimer::MakeStatsdReportSink(const std::string& host, int port, const std::string& prefix)
 {
-    std::string output;
+#if defined(_WIN32)
+    // No socket support here, use a callback sink instead
+    static_cast<void>(host);
+    static_cast<void>(port);
+    static_cast<void>(prefix);
+    return PerfReportSink();
+#else
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* address = nullptr;
+    if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &address) != 0 || address == nullptr) return PerfReportSink();
 
-    output += GenDotHeader();
-    
-    for(const auto& thread_root : tree)
+    const int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if(fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) != 0)
     {
-        output += GenDotThreadSection(thread_root.second, GetThreadIdSFF(thread_root.first));
+        if(fd >= 0) close(fd);
+        freeaddrinfo(address);
+        return PerfReportSink();
     }
+    freeaddrinfo(address);
 
-    output += GenDotFooter();
-    return output;
+    // The socket lives as long as the sink
+    std::shared_ptr<int> socket_fd(new int(fd), [](int* p) { close(*p); delete p; });
+    return [socket_fd, prefix](const std::unordered_map<std::thread::id, std::vector<PerfNode>>& delta) {
+        // Threads are merged so the number of metrics does not grow with them
+        std::vector<std::string> lines;
+        for(const auto& root : GetMergedCallTree(delta)) StatsdLines(root, StatsdName(prefix), lines);
+
+        // Fire and forget, packets stay below a typical MTU
+        constexpr std::size_t max_packet = 1432;
+        std::string packet;
+        for(const auto& line : lines)
+        {
+            if(!packet.empty() && packet.size() + line.size() + 1 > max_packet)
+            {
+                static_cast<void>(send(*socket_fd, packet.data(), packet.size(), 0));
+                packet.clear();
+            }
+            if(!packet.empty()) packet += '\n';
+            packet += line;
+        }
+        if(!packet.empty()) static_cast<void>(send(*socket_fd, packet.data(), packet.size(), 0));
+    };
+#endif
 }
 
 // =================================
 // C API
 // =================================
-static std::unordered_map<std::uint64_t, std::shared_ptr<cag::PerfTimer>> perf_timers;
+// Sites of the by name C API, one per distinct name
+static std::unordered_map<std::string, std::uint32_t> perf_sites;
+static std::unordered_map<std::string, std::uint32_t> perf_sample_rates;
+static std::mutex perf_sites_guard;
 
 extern "C" uint64_t stperf_StartProf(const char* name, int line, const char* suffix)
 {
-    std::uint64_t sid = std::hash<std::string>()(name); // BUG: (César) This could have collisions
-    std::string isuffix = suffix != nullptr ? suffix : "";
-
-    // Get or create timer
-    auto it = perf_timers.find(sid);
-    if(it == perf_timers.end())
+    // Looked up by name on every call, prefer stperf_RegisterSite + stperf_Enter on hot paths
+    std::uint32_t id;
     {
-        auto perf_timer = cag::PerfTimer::MakePerfTimer(std::string(name), line, isuffix);
-        it = perf_timers.emplace(sid, perf_timer).first;
+        std::lock_guard<std::mutex> lock(perf_sites_guard);
+        auto it = perf_sites.find(name);
+        if(it == perf_sites.end())
+        {
+            id = cag::PerfTimer::RegisterSite(name, line, suffix != nullptr ? suffix : "");
+            auto rate = perf_sample_rates.find(name);
+            if(rate != perf_sample_rates.end()) cag::PerfTimer::SetSampleRate(id, rate->second);
+            it = perf_sites.emplace(name, id).first;
+        }
+        id = it->second;
     }
-    it->second->start();
-    return sid;
+    cag::PerfTimer::Enter(id);
+    return id;
+}
+
+extern "C" void stperf_SetSampleRate(const char* name, uint32_t rate)
+{
+    // Sites are created on their first stperf_StartProf, keep the rate until then
+    std::lock_guard<std::mutex> lock(perf_sites_guard);
+    perf_sample_rates[name] = rate;
+
+    auto it = perf_sites.find(name);
+    if(it != perf_sites.end()) cag::PerfTimer::SetSampleRate(it->second, rate);
 }
 
 extern "C" void stperf_StopProf(uint64_t handle)
 {
-    auto perf_timer = perf_timers.find(handle);
-    
-    // Exit silently (no error)
-    if(perf_timer == perf_timers.end()) return; 
-    
-    perf_timer->second->stop();
+    // Exit silently (no error) on unknown handles
+    if(handle > 0xFFFFFFFFULL) return;
+    cag::PerfTimer::Exit(static_cast<std::uint32_t>(handle));
+}
+
+extern "C" uint32_t stperf_RegisterSite(const char* name, int line, const char* suffix)
+{
+    return cag::PerfTimer::RegisterSite(name != nullptr ? name : "", line, suffix != nullptr ? suffix : "");
+}
+
+extern "C" void stperf_Enter(uint32_t handle)
+{
+    cag::PerfTimer::Enter(handle);
+}
+
+extern "C" void stperf_Exit(uint32_t handle)
+{
+    cag::PerfTimer::Exit(handle);
+}
+
+extern "C" void stperf_SetSiteSampleRate(uint32_t handle, uint32_t rate)
+{
+    if(cag::PerfTimer::FindSite(handle) != nullptr) cag::PerfTimer::SetSampleRate(handle, rate);
+}
+
+extern "C" void stperf_Count(uint32_t handle, uint64_t value)
+{
+    if(cag::PerfTimer::FindSite(handle) != nullptr) cag::PerfTimer::Count(handle, value);
 }
 
 extern "C" void stperf_StopCounters()
@@ -473,18 +3841,73 @@ extern "C" void stperf_StopCounters()
     cag::PerfTimer::StopCounters();
 }
 
+// NUMA nodes past the C array are added to its last entry
+static void ToCPlacement(const cag::PerfNode& node, stperf_PerfPlacement& placement)
+{
+    memset(&placement, 0, sizeof(placement));
+    for(std::size_t i = 0; i < node._numa_hits.size(); i++)
+    {
+        const std::size_t slot = std::min<std::size_t>(i, STPERF_NUMA_NODES - 1);
+        placement._hits[slot] += node._numa_hits[i];
+        placement._nanos[slot] += node._numa_nanos[i];
+    }
+}
+
 static stperf_PerfNode* ToCHeapNode(const cag::PerfNode& node)
 {
     stperf_PerfNode* heap_node = new stperf_PerfNode();
     
     using UnderlyingType = std::underlying_type<cag::PerfNode::Granularity>::type;
     heap_node->_granularity = static_cast<UnderlyingType>(node._granularity);
-    memcpy(heap_node->_name, node._name.c_str(), std::min(sizeof(heap_node->_name), node._name.size() + 1));
+    const std::string& name = node.name();
+    const std::size_t name_size = std::min(sizeof(heap_node->_name) - 1, name.size());
+    memcpy(heap_node->_name, name.c_str(), name_size);
+    heap_node->_name[name_size] = '\0';
     heap_node->_indent = node._indent;
     heap_node->_nanos  = node._nanos;
+    heap_node->_overhead_nanos = node._overhead_nanos;
     heap_node->_value  = node._value;
     heap_node->_pct    = node._pct;
     heap_node->_hits   = node._hits;
+    heap_node->_raw_nanos = node._raw_nanos;
+    heap_node->_raw_hits  = node._raw_hits;
+    heap_node->_latency._samples    = node._latency._samples;
+    heap_node->_latency._min_nanos  = node._latency._min_nanos;
+    heap_node->_latency._max_nanos  = node._latency._max_nanos;
+    heap_node->_latency._mean_nanos = node._latency._mean_nanos;
+    heap_node->_latency._p50_nanos  = node._latency._p50_nanos;
+    heap_node->_latency._p99_nanos  = node._latency._p99_nanos;
+    heap_node->_latency._p999_nanos = node._latency._p999_nanos;
+    heap_node->_threads          = node._threads;
+    heap_node->_min_thread_nanos = node._min_thread_nanos;
+    heap_node->_max_thread_nanos = node._max_thread_nanos;
+    heap_node->_imbalance        = node._imbalance;
+    heap_node->_self_nanos       = node._self_nanos;
+    heap_node->_self_pct         = node._self_pct;
+    heap_node->_counters._cycles        = node._counters._cycles;
+    heap_node->_counters._instructions  = node._counters._instructions;
+    heap_node->_counters._cache_misses  = node._counters._cache_misses;
+    heap_node->_counters._branch_misses = node._counters._branch_misses;
+    heap_node->_cpu_nanos               = node._cpu_nanos;
+    heap_node->_off_cpu_nanos           = node._off_cpu_nanos;
+    heap_node->_suspended_nanos         = node._suspended_nanos;
+    heap_node->_max_recursion           = node._max_recursion;
+    ToCPlacement(node, heap_node->_placement);
+    heap_node->_counts._size = node._counts.size();
+    heap_node->_counts._elements = node._counts.empty() ? nullptr : new stperf_PerfCount[node._counts.size()];
+    for(std::size_t i = 0; i < node._counts.size(); i++)
+    {
+        stperf_PerfCount& count = heap_node->_counts._elements[i];
+        const std::string& count_name = node._counts[i].name();
+        const std::size_t count_name_size = std::min(sizeof(count._name) - 1, count_name.size());
+        memcpy(count._name, count_name.c_str(), count_name_size);
+        count._name[count_name_size] = '\0';
+        count._value   = node._counts[i]._value;
+        count._samples = node._counts[i]._samples;
+        count._min     = node._counts[i]._min;
+        count._max     = node._counts[i]._max;
+        count._rate    = node._counts[i]._rate;
+    }
 
     heap_node->_children._size = node._children.size();
     if(heap_node->_children._size == 0)
@@ -509,11 +3932,9 @@ static stperf_PerfNode* ToCHeapNode(const cag::PerfNode& node)
     return heap_node;
 }
 
-extern "C" stperf_PerfNodeThreadList stperf_GetCallTree()
+static stperf_PerfNodeThreadList ToCThreadList(const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& root_nodes)
 {
     stperf_PerfNodeThreadList output = { nullptr, 0 };
-
-    auto root_nodes = cag::PerfTimer::GetCallTree();
     
     if(root_nodes.size() == 0) return output;
 
@@ -548,9 +3969,81 @@ extern "C" stperf_PerfNodeThreadList stperf_GetCallTree()
     return output;
 }
 
+extern "C" stperf_PerfNodeThreadList stperf_GetCallTree()
+{
+    return ToCThreadList(cag::PerfTimer::GetCallTree());
+}
+
+extern "C" stperf_PerfNodeThreadList stperf_GetTraceCallTree(double seconds)
+{
+    return ToCThreadList(cag::PerfTimer::GetTraceCallTree(seconds));
+}
+
+struct stperf_Task
+{
+    cag::PerfTask _task;
+};
+
+extern "C" stperf_Task* stperf_CreateTask()
+{
+    return new stperf_Task();
+}
+
+extern "C" void stperf_DestroyTask(stperf_Task* task)
+{
+    delete task;
+}
+
+extern "C" void stperf_TaskEnter(stperf_Task* task, uint32_t handle)
+{
+    if(task != nullptr) task->_task.enter(handle);
+}
+
+extern "C" void stperf_TaskExit(stperf_Task* task)
+{
+    if(task != nullptr) task->_task.exit();
+}
+
+extern "C" void stperf_TaskSuspend(stperf_Task* task)
+{
+    if(task != nullptr) task->_task.suspend();
+}
+
+extern "C" void stperf_TaskResume(stperf_Task* task)
+{
+    if(task != nullptr) task->_task.resume();
+}
+
+extern "C" stperf_PerfNodeList stperf_GetTaskCallTree()
+{
+    const std::vector<cag::PerfNode> tasks = cag::PerfTimer::GetTaskCallTree();
+    stperf_PerfNodeList output = { nullptr, tasks.size(), 0 };
+    if(output._size == 0) return output;
+
+    output._elements = new stperf_PerfNode*[output._size];
+    for(uint64_t i = 0; i < output._size; i++)
+    {
+        output._elements[i] = ToCHeapNode(tasks[i]);
+    }
+    return output;
+}
+
+extern "C" stperf_PerfNodeList stperf_GetMergedCallTree()
+{
+    const std::vector<cag::PerfNode> merged = cag::PerfTimer::GetMergedCallTree();
+    stperf_PerfNodeList output = { nullptr, merged.size(), 0 };
+    if(output._size == 0) return output;
+
+    output._elements = new stperf_PerfNode*[output._size];
+    for(uint64_t i = 0; i < output._size; i++)
+    {
+        output._elements[i] = ToCHeapNode(merged[i]);
+    }
+    return output;
+}
+
 extern "C" const char* stperf_GetCallTreeDot()
 {
-    std::stringstream ss;
     std::string output_s = cag::PerfTimer::GetCallTreeDot(cag::PerfTimer::GetCallTree());
 
     char* output = new char[output_s.size() + 1];
@@ -561,6 +4054,43 @@ extern "C" const char* stperf_GetCallTreeDot()
 
 }
 
+extern "C" const char* stperf_GetCallTreeFolded()
+{
+    std::string output_s = cag::PerfTimer::GetCallTreeFolded(cag::PerfTimer::GetCallTree());
+
+    char* output = new char[output_s.size() + 1];
+    memcpy(output, output_s.c_str(), output_s.size() + 1);
+    return output;
+}
+
+extern "C" stperf_PerfHotspotList stperf_GetTopSelfTime(uint64_t count)
+{
+    const auto hotspots = cag::PerfTimer::GetTopSelfTime(cag::PerfTimer::GetCallTree(), static_cast<std::size_t>(count));
+    stperf_PerfHotspotList output = { nullptr, hotspots.size() };
+    if(output._size == 0) return output;
+
+    output._elements = new stperf_PerfHotspot[output._size];
+    for(uint64_t i = 0; i < output._size; i++)
+    {
+        stperf_PerfHotspot& chotspot = output._elements[i];
+        const std::string& name = cag::PerfTimer::GetSite(hotspots[i]._id)._name;
+        const std::size_t name_size = std::min(sizeof(chotspot._name) - 1, name.size());
+        memcpy(chotspot._name, name.c_str(), name_size);
+        chotspot._name[name_size] = '\0';
+        chotspot._self_nanos = hotspots[i]._self_nanos;
+        chotspot._nanos      = hotspots[i]._nanos;
+        chotspot._hits       = hotspots[i]._hits;
+        chotspot._threads    = hotspots[i]._threads;
+        chotspot._self_pct   = hotspots[i]._self_pct;
+    }
+    return output;
+}
+
+extern "C" void stperf_FreeTopSelfTime(stperf_PerfHotspotList list)
+{
+    delete[] list._elements;
+}
+
 extern "C" stperf_PerfNodeList* stperf_GetThreadRoot(const stperf_PerfNodeThreadList* tree, uint64_t tid)
 {
     if(tree->_size == 0) return nullptr;
@@ -571,7 +4101,7 @@ extern "C" stperf_PerfNodeList* stperf_GetThreadRoot(const stperf_PerfNodeThread
     return nullptr;
 }
 
-static void CPerfNodeSS(stperf_PerfNode node, std::stringstream& ss)
+static void CPerfNodeSS(const stperf_PerfNode& node, TextBuffer& ss)
 {
     // Indent this node from parent count
     for(int i = 0; i < node._indent; i++) ss << '\t';
@@ -579,14 +4109,39 @@ static void CPerfNodeSS(stperf_PerfNode node, std::stringstream& ss)
     // Print stats
     ss << "-> [" << node._name;
     if(node._hits > 0) ss << " | x" << node._hits;
+    if(node._raw_hits != node._hits) ss << " (sampled x" << node._raw_hits << ")";
     ss << "] Execution time : ";
-    ss << node._value << cag::PerfNode::_time_suffix.at(static_cast<cag::PerfNode::Granularity>(node._granularity)) << " (";
-    const auto default_precision = std::cout.precision();
-    ss << std::setw(3) << std::setprecision(4) << 100 * node._pct << std::setprecision(default_precision) << "%).";
-    ss << std::endl;
+    ss << node._value << TimeSuffix(static_cast<cag::PerfNode::Granularity>(node._granularity)) << " (";
+    ss.number(100 * node._pct, 4, 3) << "%).";
+    if(node._children._size > 0) PrintSelfTime(ss, node._self_nanos, node._self_pct);
+    if(node._latency._samples > 0)
+    {
+        const cag::PerfLatency latency = {
+            node._latency._samples, node._latency._min_nanos, node._latency._max_nanos, node._latency._mean_nanos,
+            node._latency._p50_nanos, node._latency._p99_nanos, node._latency._p999_nanos
+        };
+        PrintLatency(ss, latency);
+    }
+    if(node._threads > 1) PrintThreadSpread(ss, node._threads, node._min_thread_nanos, node._max_thread_nanos, node._imbalance);
+    if(node._cpu_nanos > 0) PrintCpuTime(ss, node._cpu_nanos, node._off_cpu_nanos);
+    if(node._suspended_nanos > 0) PrintTaskTime(ss, node._nanos, node._suspended_nanos);
+    if(node._max_recursion > 0) ss << " Recursion : max depth " << node._max_recursion << ".";
+    PrintPlacement(ss, node._placement._hits, node._placement._nanos, STPERF_NUMA_NODES);
+    if(node._counters._cycles > 0)
+    {
+        const cag::PerfCounters counters = {
+            node._counters._cycles, node._counters._instructions, node._counters._cache_misses, node._counters._branch_misses
+        };
+        PrintCounters(ss, counters);
+    }
+    for(uint64_t i = 0; i < node._counts._size; i++)
+    {
+        PrintCount(ss, node._counts._elements[i]._name, node._counts._elements[i]._value, node._counts._elements[i]._rate);
+    }
+    ss << '\n';
 }
 
-static void CPerfNodeListSS(stperf_PerfNodeList list, std::stringstream& ss)
+static void CPerfNodeListSS(const stperf_PerfNodeList& list, TextBuffer& ss)
 {
     for(uint64_t i = 0; i < list._size; i++)
     {
@@ -595,30 +4150,33 @@ static void CPerfNodeListSS(stperf_PerfNodeList list, std::stringstream& ss)
     }
 }
 
-static std::string GetCallTreeString(stperf_PerfNodeList tree)
+static void GetCallTreeString(const stperf_PerfNodeList& tree, TextBuffer& ss)
 {
-    std::stringstream ss;
+    const double overhead = cag::PerfTimer::GetScopeOverhead();
+    std::uint64_t thread_overhead = 0;
+    std::vector<std::uint64_t> numa_hits, numa_nanos;
+    for(uint64_t i = 0; i < tree._size; i++)
+    {
+        thread_overhead += tree._elements[i]->_overhead_nanos + static_cast<std::uint64_t>(static_cast<double>(tree._elements[i]->_raw_hits) * overhead);
+        AddPlacement(numa_hits, numa_nanos, tree._elements[i]->_placement._hits, tree._elements[i]->_placement._nanos, STPERF_NUMA_NODES);
+    }
+    PrintThreadHeader(ss, tree._thread_id, thread_overhead, numa_hits, numa_nanos);
+
     for(uint64_t i = 0; i < tree._size; i++)
     {
-        ss << "[Thread - " << tree._thread_id << "]" << std::endl;
         CPerfNodeSS(*tree._elements[i], ss);
         if(tree._elements[i]->_children._size != 0) CPerfNodeListSS(tree._elements[i]->_children, ss);
     }
-    return ss.str();
 }
 
 extern "C" const char* stperf_GetCallTreeString(stperf_PerfNodeThreadList tree)
 {
-    std::stringstream ss;
-    std::vector<std::string> output_vec;
-    output_vec.reserve(tree._size);
+    TextBuffer ss;
     for(uint64_t i = 0; i < tree._size; i++)
     {
-        output_vec.push_back(GetCallTreeString(tree._elements[i]));
+        GetCallTreeString(tree._elements[i], ss);
     }
-
-    std::string output_s;
-    for (const auto& s : output_vec) output_s += s;
+    const std::string& output_s = ss._text;
 
     char* output = new char[output_s.size() + 1];
     // Silently ignore
@@ -639,6 +4197,7 @@ static void FreeCallTreeList(stperf_PerfNodeList root)
         for(uint64_t i = 0; i < root._size; i++)
         {
             FreeCallTreeList(root._elements[i]->_children);
+            delete[] root._elements[i]->_counts._elements;
             delete root._elements[i];
         }
         delete[] root._elements;
@@ -651,6 +4210,279 @@ extern "C" void stperf_FreeCallTree(stperf_PerfNodeThreadList tree)
     {
         FreeCallTreeList(tree._elements[i]);
     }
+    delete[] tree._elements;
+}
+
+// First pass, sizes the block and builds the string table (each site name once)
+static std::uint64_t CountCNodes(const std::vector<cag::PerfNode>& nodes, std::unordered_map<std::uint32_t, std::uint32_t>& names, std::string& strings)
+{
+    std::uint64_t count = nodes.size();
+    for(const auto& node : nodes)
+    {
+        if(names.find(node._id) == names.end())
+        {
+            names.emplace(node._id, static_cast<std::uint32_t>(strings.size()));
+            strings += node.name();
+            strings += '\0';
+        }
+        count += CountCNodes(node._children, names, strings);
+    }
+    return count;
+}
+
+static void FlattenCNodes(const std::vector<cag::PerfNode>& nodes, std::uint32_t parent,
+                          const std::unordered_map<std::uint32_t, std::uint32_t>& names,
+                          stperf_FlatNode* output, std::uint32_t& size)
+{
+    std::uint32_t previous = STPERF_FLAT_NONE;
+    for(const auto& node : nodes)
+    {
+        const std::uint32_t index = size++;
+        if(previous != STPERF_FLAT_NONE) output[previous]._next_sibling = index;
+        else if(parent != STPERF_FLAT_NONE) output[parent]._first_child = index;
+        previous = index;
+
+        stperf_FlatNode& flat_node = output[index];
+        memset(&flat_node, 0, sizeof(flat_node));
+
+        using UnderlyingType = std::underlying_type<cag::PerfNode::Granularity>::type;
+        flat_node._granularity = static_cast<UnderlyingType>(node._granularity);
+        flat_node._indent = node._indent;
+        flat_node._nanos  = node._nanos;
+        flat_node._overhead_nanos = node._overhead_nanos;
+        flat_node._value  = node._value;
+        flat_node._pct    = node._pct;
+        flat_node._hits   = node._hits;
+        flat_node._raw_nanos = node._raw_nanos;
+        flat_node._raw_hits  = node._raw_hits;
+        flat_node._latency._samples    = node._latency._samples;
+        flat_node._latency._min_nanos  = node._latency._min_nanos;
+        flat_node._latency._max_nanos  = node._latency._max_nanos;
+        flat_node._latency._mean_nanos = node._latency._mean_nanos;
+        flat_node._latency._p50_nanos  = node._latency._p50_nanos;
+        flat_node._latency._p99_nanos  = node._latency._p99_nanos;
+        flat_node._latency._p999_nanos = node._latency._p999_nanos;
+        flat_node._threads          = node._threads;
+        flat_node._min_thread_nanos = node._min_thread_nanos;
+        flat_node._max_thread_nanos = node._max_thread_nanos;
+        flat_node._imbalance        = node._imbalance;
+        flat_node._self_nanos       = node._self_nanos;
+        flat_node._self_pct         = node._self_pct;
+        flat_node._counters._cycles        = node._counters._cycles;
+        flat_node._counters._instructions  = node._counters._instructions;
+        flat_node._counters._cache_misses  = node._counters._cache_misses;
+        flat_node._counters._branch_misses = node._counters._branch_misses;
+        flat_node._cpu_nanos               = node._cpu_nanos;
+        flat_node._off_cpu_nanos           = node._off_cpu_nanos;
+        flat_node._max_recursion           = node._max_recursion;
+        ToCPlacement(node, flat_node._placement);
+        flat_node._parent       = parent;
+        flat_node._first_child  = STPERF_FLAT_NONE;
+        flat_node._next_sibling = STPERF_FLAT_NONE;
+        flat_node._name         = names.find(node._id)->second;
+
+        // Preorder, the children follow right after their parent
+        FlattenCNodes(node._children, index, names, output, size);
+    }
+}
+
+extern "C" stperf_FlatTree stperf_GetFlatCallTree()
+{
+    const auto tree = cag::PerfTimer::GetCallTree();
+
+    std::unordered_map<std::uint32_t, std::uint32_t> names;
+    std::string strings;
+    std::uint64_t node_count = 0;
+    for(const auto& thread_root : tree) node_count += CountCNodes(thread_root.second, names, strings);
+
+    // One block written in place, sections are 8 byte aligned so every struct is naturally aligned
+    const std::uint64_t threads_size = AlignDump(tree.size() * sizeof(stperf_FlatThread));
+    const std::uint64_t nodes_size = AlignDump(node_count * sizeof(stperf_FlatNode));
+    char* block = new char[threads_size + nodes_size + strings.size() + 1];
+    stperf_FlatThread* threads = reinterpret_cast<stperf_FlatThread*>(block);
+    stperf_FlatNode* nodes = reinterpret_cast<stperf_FlatNode*>(block + threads_size);
+    memcpy(block + threads_size + nodes_size, strings.c_str(), strings.size() + 1);
+
+    std::uint32_t size = 0;
+    std::uint64_t n = 0;
+    for(const auto& thread_root : tree)
+    {
+        const std::uint32_t first = size;
+        FlattenCNodes(thread_root.second, STPERF_FLAT_NONE, names, nodes, size);
+        threads[n]._thread_id = GetThreadIdSFF(thread_root.first);
+        threads[n]._first_node = size > first ? first : STPERF_FLAT_NONE;
+        threads[n]._node_count = size - first;
+        n++;
+    }
+
+    stperf_FlatTree output;
+    output._threads = threads;
+    output._thread_count = tree.size();
+    output._nodes = nodes;
+    output._node_count = node_count;
+    output._strings = block + threads_size + nodes_size;
+    output._strings_size = strings.size();
+    output._block = block;
+    return output;
+}
+
+extern "C" void stperf_FreeFlatCallTree(stperf_FlatTree tree)
+{
+    delete[] static_cast<char*>(tree._block);
+}
+
+extern "C" void stperf_FreeMergedCallTree(stperf_PerfNodeList tree)
+{
+    FreeCallTreeList(tree);
+}
+
+extern "C" void stperf_FreeTaskCallTree(stperf_PerfNodeList tree)
+{
+    FreeCallTreeList(tree);
+}
+
+extern "C" const char* stperf_GetChromeTrace(double seconds)
+{
+    std::string output_s = cag::PerfTimer::GetChromeTrace(seconds);
+
+    char* output = new char[output_s.size() + 1];
+    memcpy(output, output_s.c_str(), output_s.size() + 1);
+    return output;
+}
+
+extern "C" int stperf_WriteChromeTrace(const char* path, double seconds)
+{
+    std::ofstream file(path, std::ios::out | std::ios::trunc);
+    if(!file) return -1;
+    cag::PerfTimer::WriteChromeTrace(file, seconds);
+    file.close();
+    return file ? 0 : -1;
+}
+
+extern "C" int stperf_StartReporter(uint32_t interval_ms, stperf_ReporterSink sink)
+{
+    cag::PerfReportSink report_sink;
+    switch(sink._kind)
+    {
+        case STPERF_SINK_CALLBACK:
+        {
+            if(sink._callback == nullptr) return -1;
+            const stperf_ReportCallback callback = sink._callback;
+            void* const user = sink._user;
+            report_sink = [callback, user](const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& delta) {
+                stperf_PerfNodeThreadList list = ToCThreadList(delta);
+                callback(&list, user);
+                stperf_FreeCallTree(list);
+            };
+            break;
+        }
+        case STPERF_SINK_FILE:
+            if(sink._target == nullptr) return -1;
+            report_sink = cag::PerfTimer::MakeFileReportSink(sink._target);
+            break;
+        case STPERF_SINK_STATSD:
+        {
+            if(sink._target == nullptr) return -1;
+            const std::string target(sink._target);
+            const std::size_t colon = target.rfind(':');
+            if(colon == std::string::npos) return -1;
+            report_sink = cag::PerfTimer::MakeStatsdReportSink(target.substr(0, colon), std::atoi(target.c_str() + colon + 1));
+            break;
+        }
+        default:
+            return -1;
+    }
+    return cag::PerfTimer::StartReporter(std::chrono::milliseconds(interval_ms), report_sink) ? 0 : -1;
+}
+
+extern "C" void stperf_StopReporter()
+{
+    cag::PerfTimer::StopReporter();
+}
+
+extern "C" int stperf_WriteCallTreeDump(const char* path)
+{
+    return cag::PerfTimer::WriteCallTreeDump(path, cag::PerfTimer::GetCallTree()) ? 0 : -1;
+}
+
+extern "C" int stperf_OpenDump(const char* path, stperf_DumpView* view)
+{
+    memset(view, 0, sizeof(*view));
+
+#if defined(_WIN32)
+    // No mapping here, read the whole file once instead
+    const int fd = _open(path, _O_RDONLY | _O_BINARY);
+    if(fd < 0) return -1;
+    struct _stat64 st;
+    if(_fstat64(fd, &st) != 0 || st.st_size <= 0) { _close(fd); return -1; }
+    const std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+    char* base = new char[size];
+    std::uint64_t read_size = 0;
+    while(read_size < size)
+    {
+        const int n = _read(fd, base + read_size, static_cast<unsigned int>(std::min<std::uint64_t>(size - read_size, 1U << 30)));
+        if(n <= 0) break;
+        read_size += static_cast<std::uint64_t>(n);
+    }
+    _close(fd);
+    if(read_size != size || !ValidateDump(base, size, view))
+    {
+        delete[] base;
+        memset(view, 0, sizeof(*view));
+        return -1;
+    }
+#else
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0) return -1;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) { close(fd); return -1; }
+    const std::uint64_t size = static_cast<std::uint64_t>(st.st_size);
+    void* base = mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return -1;
+    if(!ValidateDump(base, size, view))
+    {
+        munmap(base, static_cast<std::size_t>(size));
+        memset(view, 0, sizeof(*view));
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+extern "C" const stperf_DumpNode* stperf_GetDumpNodes(const stperf_DumpView* view, uint64_t thread)
+{
+    if(view->_header == nullptr || thread >= view->_header->_thread_count) return nullptr;
+    return reinterpret_cast<const stperf_DumpNode*>(static_cast<const char*>(view->_base) + view->_threads[thread]._nodes_offset);
+}
+
+extern "C" void stperf_CloseDump(stperf_DumpView* view)
+{
+    if(view->_base == nullptr) return;
+#if defined(_WIN32)
+    delete[] static_cast<const char*>(view->_base);
+#else
+    munmap(const_cast<void*>(view->_base), static_cast<std::size_t>(view->_size));
+#endif
+    memset(view, 0, sizeof(*view));
+}
+
+extern "C" const char* stperf_GetCallTreeDiff(const char* before_dump, const char* after_dump, int format)
+{
+    std::vector<cag::PerfDiffNode> diff;
+    if(!cag::PerfTimer::GetCallTreeDiff(before_dump, after_dump, diff)) return nullptr;
+
+    std::string output_s;
+    switch(format)
+    {
+        case STPERF_DIFF_DOT:    output_s = cag::PerfTimer::GetCallTreeDiffDot(diff); break;
+        case STPERF_DIFF_FOLDED: output_s = cag::PerfTimer::GetCallTreeDiffFolded(diff); break;
+        default:                 output_s = cag::PerfTimer::GetCallTreeDiffString(diff); break;
+    }
+
+    char* output = new char[output_s.size() + 1];
+    memcpy(output, output_s.c_str(), output_s.size() + 1);
+    return output;
 }
 
 extern "C" void stperf_ResetCounters()
@@ -664,3 +4496,99 @@ extern "C" uint64_t stperf_GetCurrentThreadId()
     return GetThreadIdSFF(std::this_thread::get_id());
 }
 
+extern "C" void stperf_SetClockSource(int source)
+{
+    cag::PerfTimer::SetClockSource(static_cast<cag::PerfClockSource>(source));
+}
+
+extern "C" double stperf_GetScopeOverhead()
+{
+    return cag::PerfTimer::GetScopeOverhead();
+}
+
+extern "C" void stperf_SetOverheadCompensation(int enable)
+{
+    cag::PerfTimer::SetOverheadCompensation(enable != 0);
+}
+
+extern "C" void stperf_SetTraceEnabled(int enable)
+{
+    cag::PerfTimer::SetTraceEnabled(enable != 0);
+}
+
+extern "C" void stperf_SetHistogramsEnabled(int enable)
+{
+    cag::PerfTimer::SetHistogramsEnabled(enable != 0);
+}
+
+extern "C" int stperf_SetHardwareCountersEnabled(int enable)
+{
+    return cag::PerfTimer::SetHardwareCountersEnabled(enable != 0) ? 1 : 0;
+}
+
+extern "C" int stperf_SetCpuTimeEnabled(int enable)
+{
+    return cag::PerfTimer::SetCpuTimeEnabled(enable != 0) ? 1 : 0;
+}
+
+extern "C" int stperf_SetPlacementEnabled(int enable)
+{
+    return cag::PerfTimer::SetPlacementEnabled(enable != 0) ? 1 : 0;
+}
+
+extern "C" void stperf_SetThreadName(const char* name)
+{
+    cag::PerfTimer::SetThreadName(name != nullptr ? name : "");
+}
+
+extern "C" stperf_ThreadInfoList stperf_GetThreadInfo()
+{
+    const auto threads = cag::PerfTimer::GetThreadInfo();
+    stperf_ThreadInfoList output = { nullptr, threads.size() };
+    if(threads.empty()) return output;
+
+    output._elements = new stperf_ThreadInfo[threads.size()];
+    std::size_t n = 0;
+    for(const auto& thread : threads)
+    {
+        stperf_ThreadInfo& info = output._elements[n++];
+        info._thread_id = thread.second._thread_id;
+        info._os_tid = thread.second._os_tid;
+        const std::size_t name_size = std::min(sizeof(info._name) - 1, thread.second._name.size());
+        memcpy(info._name, thread.second._name.c_str(), name_size);
+        info._name[name_size] = '\0';
+        info._alive = thread.second._alive ? 1 : 0;
+        info._last_cpu = thread.second._last_cpu;
+        info._last_numa = thread.second._last_numa;
+        info._cpu_migrations = thread.second._cpu_migrations;
+        info._numa_migrations = thread.second._numa_migrations;
+    }
+    return output;
+}
+
+extern "C" void stperf_FreeThreadInfo(stperf_ThreadInfoList list)
+{
+    delete[] list._elements;
+}
+
+extern "C" void stperf_SetTreeLimits(uint32_t max_depth, uint32_t max_nodes)
+{
+    cag::PerfTimer::SetTreeLimits(max_depth, max_nodes);
+}
+
+extern "C" void stperf_SetRecursionCollapse(int enable)
+{
+    cag::PerfTimer::SetRecursionCollapse(enable != 0);
+}
+
+extern "C" void stperf_SetTraceBufferSize(uint64_t events)
+{
+    cag::PerfTimer::SetTraceBufferSize(events);
+}
+
+extern "C" int stperf_GetClockSource()
+{
+    using UnderlyingType = std::underlying_type<cag::PerfClockSource>::type;
+    return static_cast<UnderlyingType>(cag::PerfTimer::GetClockSource());
+}
+
@@ -1,8 +1,11 @@
 // (c) 2023 César Godinho
 // This code is licensed under MIT license (see LICENSE for details)
 
+#include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <stack>
@@ -16,6 +19,50 @@
 namespace cag
 {
     class PerfTimer;
+    struct PerfNode;
+
+    // Receives what happened during each reporter interval, called from the reporter thread
+    using PerfReportSink = std::function<void(const std::unordered_map<std::thread::id, std::vector<PerfNode>>&)>;
+
+    // Where scope timestamps come from
+    // Auto picks Hardware (invariant TSC / ARM generic timer) when available
+    enum class PerfClockSource { Auto, Chrono, Hardware };
+
+    // Latency distribution of a node, all zero when histograms were off
+    struct PerfLatency
+    {
+        std::uint64_t _samples;
+        std::uint64_t _min_nanos;
+        std::uint64_t _max_nanos;
+        std::uint64_t _mean_nanos;
+        std::uint64_t _p50_nanos;
+        std::uint64_t _p99_nanos;
+        std::uint64_t _p999_nanos;
+    };
+
+    // Hardware counter totals of a node, all zero when counters were off or unavailable
+    struct PerfCounters
+    {
+        static constexpr std::uint32_t COUNT = 4;
+
+        std::uint64_t _cycles;
+        std::uint64_t _instructions;
+        std::uint64_t _cache_misses; // Last level cache
+        std::uint64_t _branch_misses;
+    };
+
+    // Values added with ST_COUNT inside a node, summed like its time
+    struct PerfCount
+    {
+        std::uint32_t _id; // Site naming the value
+        std::uint64_t _value;
+        std::uint64_t _samples; // ST_COUNT calls
+        std::uint64_t _min; // Of a single call
+        std::uint64_t _max;
+        double _rate; // _value per second of the node's _nanos
+
+        const std::string& name() const;
+    };
 
     struct PerfNode
     {
@@ -24,41 +71,425 @@ namespace cag
         float _value;
         float _pct;
         std::uint64_t _nanos;
-        std::string _name;
+        std::uint64_t _overhead_nanos; // Estimated profiler cost of the scopes below this node
+        std::uint32_t _id;
         int _indent;
         std::vector<PerfNode> _children;
         std::uint64_t _hits;
+        std::uint64_t _raw_nanos; // What was actually measured, _nanos/_hits are extrapolated for sampled sites
+        std::uint64_t _raw_hits;
+        PerfLatency _latency;
+        std::vector<std::uint64_t> _histogram; // PerfHistogram bucket counts, empty when histograms were off
+        std::uint64_t _threads; // Threads that went through this call path, 1 unless merged
+        std::uint64_t _min_thread_nanos;
+        std::uint64_t _max_thread_nanos;
+        float _imbalance; // Slowest thread over the mean of _threads, minus one
+        std::uint64_t _self_nanos; // Time not spent in any child scope
+        float _self_pct;
+        PerfCounters _counters;
+        std::uint64_t _cpu_nanos; // On CPU part of _nanos, 0 when CPU time was off
+        std::uint64_t _off_cpu_nanos; // Blocked or preempted, what is left of _nanos
+        std::uint64_t _suspended_nanos; // Task trees only, part of _nanos the task was suspended
+        std::vector<PerfCount> _counts;
+        std::uint64_t _max_recursion; // Most nested calls one outer call folded into this node, 0 if it never recursed
+        std::vector<std::uint64_t> _recursion; // Outer calls per recursion depth, bucket i is [2^i, 2^(i+1)) calls deep
+        std::vector<std::uint64_t> _numa_hits; // Entries per NUMA node they started on, empty when placement was off
+        std::vector<std::uint64_t> _numa_nanos; // Time of those entries
 
+        const std::string& name() const;
         void print(std::stringstream& ss) const;
     };
+
+    // Flat per site totals over every call path and thread
+    struct PerfHotspot
+    {
+        std::uint32_t _id;
+        std::uint64_t _self_nanos;
+        std::uint64_t _nanos; // Inclusive, recursive entries are only counted once
+        std::uint64_t _hits;
+        std::uint64_t _threads;
+        float _self_pct; // Of the time of all thread roots together
+    };
+
+    // Node of a before/after comparison, threads merged and paths matched by name
+    struct PerfDiffNode
+    {
+        std::string _name;
+        int _indent;
+        std::uint64_t _before_nanos;
+        std::uint64_t _after_nanos;
+        std::uint64_t _before_self_nanos;
+        std::uint64_t _after_self_nanos;
+        std::uint64_t _before_hits;
+        std::uint64_t _after_hits;
+        std::int64_t _delta_nanos;
+        std::int64_t _delta_hits;
+        double _change; // _delta_nanos relative to _before_nanos, infinity for paths new in after
+        std::vector<PerfDiffNode> _children; // Biggest regression first
+    };
+
+    // Identity and placement of a thread that recorded scopes
+    struct PerfThreadInfo
+    {
+        std::uint64_t _thread_id; // Index used in the reports
+        std::uint64_t _os_tid; // 0 where the OS has none
+        std::string _name; // From SetThreadName, otherwise the OS name read when the thread started recording
+        bool _alive;
+        std::uint32_t _last_cpu; // UINT32_MAX until placement saw the thread
+        std::uint32_t _last_numa;
+        std::uint64_t _cpu_migrations; // Scope entries on another CPU than the entry before
+        std::uint64_t _numa_migrations; // Those that also changed NUMA node
+    };
+
+    // Call site metadata, interned once per timer
+    // Only the sampling rate may change after registration
+    struct PerfSite
+    {
+        std::string _name;
+        int _line;
+        std::uint32_t _id;
+        mutable std::atomic<std::uint32_t> _sample_rate; // Record 1 in _sample_rate entries
+
+        PerfSite(const std::string& name, int line, std::uint32_t id, std::uint32_t sample_rate);
+    };
+
+    // Fixed size log-linear (HDR style) histogram of scope durations
+    // 16 linear sub-buckets per power of two, so values are within ~6%
+    struct PerfHistogram
+    {
+        static constexpr std::uint32_t SUB_BITS = 4;
+        static constexpr std::uint32_t MAX_EXPONENT = 42; // ~73 min, longer scopes land in the last bucket
+        static constexpr std::uint32_t BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) << SUB_BITS;
+
+        std::atomic<std::uint64_t> _min_nanos;
+        std::atomic<std::uint64_t> _max_nanos;
+        std::atomic<std::uint64_t> _counts[BUCKETS];
+
+        PerfHistogram();
+        void record(std::uint64_t nanos, std::uint64_t weight);
+        static std::uint32_t BucketIndex(std::uint64_t nanos);
+        static std::uint64_t BucketValue(std::uint32_t index);
+    };
+
+    // Depths of the direct self recursion folded into a tree node
+    struct PerfRecursionHistogram
+    {
+        static constexpr std::uint32_t BUCKETS = 32; // Power of two buckets, bucket 0 never recursed
+
+        std::atomic<std::uint64_t> _max_depth;
+        std::atomic<std::uint64_t> _counts[BUCKETS];
+
+        PerfRecursionHistogram();
+    };
+
+    // Entries and time of a tree node per NUMA node, sized once from the machine topology
+    struct PerfPlacementCounts
+    {
+        std::uint32_t _nodes;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> _hits;
+        std::unique_ptr<std::atomic<std::uint64_t>[]> _nanos;
+
+        explicit PerfPlacementCounts(std::uint32_t nodes);
+    };
+
+    // ST_COUNT accumulator of a tree node, a list appended to by the owner only
+    struct PerfCountSlot
+    {
+        std::uint32_t _id;
+        std::atomic<std::uint64_t> _value;
+        std::atomic<std::uint64_t> _samples;
+        std::atomic<std::uint64_t> _min;
+        std::atomic<std::uint64_t> _max;
+        PerfCountSlot* _next; // Immutable once published
+
+        explicit PerfCountSlot(std::uint32_t id, PerfCountSlot* next);
+    };
+
+    // Recording node of the per thread calling context tree
+    // Nodes are keyed by (parent, timer) so repeated calls only accumulate here
+    // Single writer (the owner thread), snapshots read the atomics concurrently
+    // Links are indices into the owning PerfTree, 0 (the root) meaning none
+    struct PerfTreeNode
+    {
+        std::uint32_t _id;
+        std::uint32_t _last_child; // Owner only
+        std::atomic<std::uint32_t> _first_child;
+        std::atomic<std::uint32_t> _next_sibling;
+        std::atomic<std::uint64_t> _nanos;
+        std::atomic<std::uint64_t> _hits;
+        std::atomic<std::uint64_t> _raw_nanos;
+        std::atomic<std::uint64_t> _raw_hits;
+        std::atomic<PerfHistogram*> _histogram; // Allocated by the owner on first use
+        std::atomic<std::uint64_t> _counters[PerfCounters::COUNT]; // Same order as PerfCounters
+        std::atomic<std::uint64_t> _cpu_nanos;
+        std::atomic<PerfCountSlot*> _counts; // Newest first
+        std::atomic<PerfRecursionHistogram*> _recursion; // Allocated by the owner on the first recursion
+        std::atomic<std::uint64_t> _folded_hits; // Part of _raw_hits entered below an entry of the same node
+        std::atomic<PerfPlacementCounts*> _placement; // Allocated by the owner on the first placed exit
+
+        PerfTreeNode();
+        ~PerfTreeNode();
+    };
+
+    // Per thread node arena, only ever allocated by its owner
+    // Chunks double in size and never move, so node addresses stay valid
+    class PerfTree
+    {
+    public:
+        PerfTree();
+        ~PerfTree();
+        PerfTree(const PerfTree&) = delete;
+        PerfTree& operator=(const PerfTree&) = delete;
+
+        PerfTreeNode& root() const { return node(0); }
+        PerfTreeNode& node(std::uint32_t index) const;
+        PerfTreeNode* firstChild(const PerfTreeNode& node) const;
+        PerfTreeNode* nextSibling(const PerfTreeNode& node) const;
+        PerfTreeNode* findChild(const PerfTreeNode* parent, std::uint32_t id) const;
+        PerfTreeNode* findOrAddChild(PerfTreeNode* parent, std::uint32_t id);
+        std::uint32_t size() const { return _size.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr std::uint32_t FIRST_CHUNK_BITS = 6;
+        static constexpr std::uint32_t MAX_CHUNKS = 25;
+
+        std::atomic<PerfTreeNode*> _chunks[MAX_CHUNKS];
+        std::atomic<std::uint32_t> _size; // Written by the owner only, snapshots read it as a hint
+    };
+
+    // Entry of the per thread scope stack
+    // The start time lives here so a timer shared by many threads stays immutable
+    struct PerfScopeFrame
+    {
+        PerfTreeNode* _node;
+        std::uint64_t _ticks;
+        std::uint64_t _weight; // Entries this one stands for, the product of the sampling rates above
+        std::uint32_t _id;
+        bool _counted; // _counters holds the values read on entry
+        std::uint64_t _cpu_start; // Thread CPU time on entry, UINT64_MAX when not measured
+        std::uint64_t _counters[PerfCounters::COUNT];
+        std::uint32_t _depth; // Of _node in the tree, 1 for the roots
+        std::uint32_t _recursion; // Direct self recursion level folded onto _node, 0 for the outer entry
+        std::uint32_t _max_recursion; // Deepest level reached below this entry
+        bool _folded; // _node already gets the time from an entry above, only hits are added
+        bool _overflow; // _node is an overflow bucket, everything below lands in it too
+        std::uint32_t _numa; // Node the scope started on, UINT32_MAX when placement was off
+    };
+
+    // Compact begin/end record of the trace ring buffer
+    struct PerfTraceEvent
+    {
+        enum Kind : std::uint32_t { Begin, End };
+        std::atomic<std::uint64_t> _ticks;
+        std::atomic<std::uint32_t> _id;
+        std::atomic<std::uint32_t> _kind;
+    };
+
+    // Fixed size single writer ring, the oldest events get overwritten
+    struct PerfTraceRing
+    {
+        std::uint64_t _capacity;
+        std::atomic<std::uint64_t> _claimed;
+        std::atomic<std::uint64_t> _head;
+        std::atomic<std::uint64_t> _floor;
+        std::unique_ptr<PerfTraceEvent[]> _events;
+
+        explicit PerfTraceRing(std::uint64_t capacity);
+        void push(std::uint32_t id, std::uint64_t ticks, PerfTraceEvent::Kind kind);
+    };
+
+    // Per thread perf_event group, only defined where the OS has one
+    struct PerfCounterGroup;
+
+    // Recording state of a single thread, reached via a thread_local pointer
+    // Registered once per thread, owned by PerfTimer::_contexts
+    struct PerfThreadContext
+    {
+        std::thread::id _thread_id;
+        std::atomic<std::uint64_t> _generation;
+        std::atomic<bool> _alive;
+        std::atomic<PerfTree*> _tree;
+        std::vector<std::unique_ptr<PerfTree>> _retired;
+        std::mutex _retired_guard;
+        std::stack<PerfScopeFrame> _scope_stack;
+        std::uint64_t _unsampled_depth; // Open scopes skipped by sampling, nothing below them is recorded
+        std::uint64_t _sample_state;
+        std::atomic<PerfTraceRing*> _trace;
+        std::vector<std::unique_ptr<PerfTraceRing>> _trace_rings;
+        std::unique_ptr<PerfCounterGroup> _counter_group; // Opened on the first counted scope
+        bool _counters_failed;
+        std::atomic<std::uint32_t> _last_cpu; // Placement of the last sampled entry, UINT32_MAX before the first
+        std::atomic<std::uint32_t> _last_numa;
+        std::atomic<std::uint64_t> _cpu_migrations;
+        std::atomic<std::uint64_t> _numa_migrations;
+
+        explicit PerfThreadContext(std::uint64_t generation);
+        ~PerfThreadContext();
+        void reset(std::uint64_t generation);
+    };
     
-    class PerfTimer : public std::enable_shared_from_this<PerfTimer>
+    // Node of a task call tree, links are indices into the same vector, 0 (the root) meaning none
+    struct PerfTaskNode
+    {
+        std::uint32_t _id;
+        std::uint32_t _first_child;
+        std::uint32_t _next_sibling;
+        std::uint64_t _nanos;
+        std::uint64_t _suspended_nanos;
+        std::uint64_t _hits;
+    };
+
+    struct PerfTaskFrame
     {
+        std::uint32_t _node; // UINT32_MAX for unknown sites, kept so enter/exit stay balanced
+        std::uint64_t _ticks;
+        std::uint64_t _suspended_ticks; // Task suspended time when the scope was entered
+    };
+
+    // Logical unit of work (scheduler task, coroutine) that may run on any thread
+    // Carries its own scope stack, scopes go to the task call tree instead of the thread ones
+    // Not thread safe, only one thread may drive a task at a time
+    class PerfTask
+    {
+    public:
+        PerfTask();
+        ~PerfTask();
+        PerfTask(const PerfTask&) = delete;
+        PerfTask& operator=(const PerfTask&) = delete;
+
+        void enter(std::uint32_t id);
+        void exit();
+        void suspend();
+        void resume();
+        bool suspended() const { return _suspended; }
+
     private:
-        PerfTimer(const std::string& name, int line, const std::string& suffix);
+        std::vector<PerfTaskNode> _nodes; // Folded into the task tree when the outermost scope exits
+        std::vector<PerfTaskFrame> _frames;
+        std::uint64_t _suspended_ticks;
+        std::uint64_t _suspend_start;
+        std::uint64_t _generation;
+        bool _suspended;
+
+        std::uint64_t suspendedTicks(std::uint64_t now) const;
+    };
+
+    // A call site, usually a function local static created by ST_PROF
+    // Literal names are registered lazily so the static needs no dynamic initialization
+    class PerfTimer
+    {
+    public:
+        constexpr PerfTimer(const char* name, int line, const char* suffix = "", std::uint32_t sample_rate = 1) :
+            _name(name), _suffix(suffix), _line(line), _sample_rate(sample_rate), _site(nullptr) {  }
+        PerfTimer(const std::string& name, int line, const std::string& suffix = "", std::uint32_t sample_rate = 1);
         PerfTimer(const PerfTimer& st) = delete;
         PerfTimer(PerfTimer&& t) = delete;
 
-        std::chrono::high_resolution_clock::time_point _tp;
-        std::string _scope_name;
-        int _line;
-        static std::unordered_map<std::thread::id, std::stack<std::weak_ptr<const PerfTimer>>> _timer_stack;
-        static std::unordered_map<std::thread::id, std::stack<PerfNode*>>  _scope_stack;
-        static std::unordered_map<std::thread::id, std::vector<PerfNode>>  _parents;
-        static std::mutex _scope_stack_guard;
+    private:
+        const char* const _name;
+        const char* const _suffix;
+        const int _line;
+        const std::uint32_t _sample_rate;
+        mutable std::atomic<const PerfSite*> _site;
+        static constexpr std::uint32_t SITE_CHUNK_BITS = 6;
+        static constexpr std::uint32_t SITE_CHUNKS = 27;
+
+        static std::deque<PerfSite> _sites;
+        static std::mutex _sites_guard;
+        static std::atomic<std::atomic<const PerfSite*>*> _site_index[SITE_CHUNKS]; // Lock free id lookup, chunks double in size
+        static std::atomic<std::uint32_t> _site_count;
+        static thread_local PerfThreadContext* _context;
+        static std::vector<std::unique_ptr<PerfThreadContext>> _contexts;
+        static std::mutex _contexts_guard; // Held only to add, remove or copy contexts, never across a snapshot
+        static std::mutex _snapshot_guard; // Serializes snapshots and keeps contexts and retired trees alive for them
+        static std::atomic<std::uint64_t> _generation;
+        static std::atomic<double> _scope_overhead;
+        static std::atomic<bool> _overhead_compensation;
+        static std::atomic<bool> _trace_enabled;
+        static std::atomic<bool> _histograms_enabled;
+        static std::atomic<bool> _counters_enabled;
+        static std::atomic<bool> _cpu_time_enabled;
+        static std::atomic<bool> _placement_enabled;
+        static std::atomic<std::uint64_t> _trace_capacity;
+        static std::atomic<std::uint32_t> _max_depth;
+        static std::atomic<std::uint32_t> _max_nodes;
+        static std::atomic<bool> _recursion_collapse;
+        static std::vector<PerfTaskNode> _task_tree;
+        static std::mutex _task_guard;
+        friend class PerfTask;
     
-        void addLeaf() const;
-        void delLeaf() const;
+        static PerfThreadContext* GetThreadContext();
+        static PerfThreadContext* RegisterThreadContext();
+        static std::vector<PerfThreadContext*> CopyContexts();
+        static void TraceEvent(PerfThreadContext* ctx, std::uint32_t id, std::uint64_t ticks, PerfTraceEvent::Kind kind);
+        static void StopScope(PerfThreadContext* ctx);
+        static void StopFoldedScope(PerfThreadContext* ctx, std::uint64_t now);
+        static void AddChild(PerfTree* tree, PerfTreeNode* parent, PerfScopeFrame& frame);
+        static bool ReadCounters(PerfThreadContext* ctx, std::uint64_t values[PerfCounters::COUNT]);
+        const PerfSite& registerLazy() const;
+        const PerfSite& site() const;
+        static void AddLeaf(PerfThreadContext* ctx, std::uint32_t id, std::uint64_t weight);
+        static void EnterSite(const PerfSite& site);
+        static void ExitSite();
 
     public:
         static std::shared_ptr<PerfTimer> MakePerfTimer(const std::string& name, int line, const std::string& suffix = "");
+        static std::uint32_t RegisterSite(const std::string& name, int line, const std::string& suffix = "", std::uint32_t sample_rate = 1);
+        static const PerfSite& GetSite(std::uint32_t id);
+        static const PerfSite* FindSite(std::uint32_t id);
+        static bool Enter(std::uint32_t id);
+        static void Exit(std::uint32_t id);
+        static void SetSampleRate(std::uint32_t id, std::uint32_t rate);
+        static std::uint32_t GetSampleRate(std::uint32_t id);
+        static void SetClockSource(PerfClockSource source);
+        static PerfClockSource GetClockSource();
+        static double GetScopeOverhead();
+        static void SetOverheadCompensation(bool enable);
+        static void SetTraceEnabled(bool enable);
+        static void SetHistogramsEnabled(bool enable);
+        static bool SetHardwareCountersEnabled(bool enable);
+        static bool SetCpuTimeEnabled(bool enable);
+        static bool SetPlacementEnabled(bool enable);
+        static void SetThreadName(const std::string& name);
+        static std::unordered_map<std::thread::id, PerfThreadInfo> GetThreadInfo();
+        static void SetTreeLimits(std::uint32_t max_depth, std::uint32_t max_nodes);
+        static void SetRecursionCollapse(bool enable);
+        static void Count(std::uint32_t id, std::uint64_t value);
+        static void SetTraceBufferSize(std::uint64_t events);
+        static std::unordered_map<std::thread::id, std::vector<PerfNode>> GetTraceCallTree(double seconds);
+        static void WriteChromeTrace(std::ostream& out, double seconds);
+        static std::string GetChromeTrace(double seconds);
         static void ResetCounters();
         static void StopCounters();
         static std::string GetCallTreeString(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree);
         static std::unordered_map<std::thread::id, std::vector<PerfNode>> GetCallTree();
         static std::string GetCallTreeDot(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree);
-        void start();
+        static std::vector<PerfHotspot> GetTopSelfTime(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree, std::size_t count);
+        static std::string GetTopSelfTimeString(const std::vector<PerfHotspot>& hotspots);
+        static std::string GetCallTreeFolded(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree);
+        static std::vector<PerfNode> GetMergedCallTree(const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree);
+        static std::vector<PerfNode> GetMergedCallTree();
+        static std::string GetMergedCallTreeString(const std::vector<PerfNode>& tree);
+        static std::vector<PerfNode> GetTaskCallTree();
+        static std::string GetTaskCallTreeString(const std::vector<PerfNode>& tree);
+        static bool WriteCallTreeDump(const std::string& path, const std::unordered_map<std::thread::id, std::vector<PerfNode>>& tree);
+        static std::vector<PerfDiffNode> GetCallTreeDiff(
+            const std::unordered_map<std::thread::id, std::vector<PerfNode>>& before,
+            const std::unordered_map<std::thread::id, std::vector<PerfNode>>& after);
+        static bool GetCallTreeDiff(const std::string& before_dump, const std::string& after_dump, std::vector<PerfDiffNode>& diff);
+        static std::string GetCallTreeDiffString(const std::vector<PerfDiffNode>& diff);
+        static std::string GetCallTreeDiffDot(const std::vector<PerfDiffNode>& diff);
+        static std::string GetCallTreeDiffFolded(const std::vector<PerfDiffNode>& diff);
+        static std::unordered_map<std::thread::id, std::vector<PerfNode>> GetCallTreeDelta(
+            const std::unordered_map<std::thread::id, std::vector<PerfNode>>& current,
+            const std::unordered_map<std::thread::id, std::vector<PerfNode>>& previous);
+        static bool StartReporter(std::chrono::milliseconds interval, PerfReportSink sink);
+        static void StopReporter();
+        static PerfReportSink MakeFileReportSink(const std::string& path);
+        static PerfReportSink MakeStatsdReportSink(const std::string& host, int port, const std::string& prefix = "stperf");
+        void start() const;
         void stop() const;
+        std::uint32_t id() const;
     };
 
     template<typename T>
@@ -71,12 +502,36 @@ namespace cag
         T& t;
     };
 
+    // Guard over a static site descriptor, no refcount involved
+    template<>
+    class ScopeGuard<const PerfTimer>
+    {
+    public:
+        explicit ScopeGuard(const PerfTimer& t) : t(t) { t.start(); }
+        ~ScopeGuard() { t.stop(); }
+    private:
+        const PerfTimer& t;
+    };
+
+    // Scope of a PerfTask, may end on another thread than the one it started on
+    class PerfTaskScope
+    {
+    public:
+        PerfTaskScope(PerfTask& task, const PerfTimer& timer) : _task(task) { _task.enter(timer.id()); }
+        ~PerfTaskScope() { _task.exit(); }
+        PerfTaskScope(const PerfTaskScope&) = delete;
+        PerfTaskScope& operator=(const PerfTaskScope&) = delete;
+    private:
+        PerfTask& _task;
+    };
+
     PerfNode::Granularity FindTimeGranularity(std::uint64_t t);
     PerfNode::Granularity FindCommonGranularity(PerfNode::Granularity g1, PerfNode::Granularity g2);
     float NanosToValue(PerfNode::Granularity g, std::uint64_t t);
 }
 
 extern "C" struct stperf_PerfNode;
+extern "C" struct stperf_Task;
 
 extern "C" struct stperf_PerfNodeList
 {
@@ -91,34 +546,322 @@ extern "C" struct stperf_PerfNodeThreadList
     uint64_t             _size;
 };
 
+extern "C" struct stperf_PerfHotspot
+{
+    char     _name[128];
+    uint64_t _self_nanos;
+    uint64_t _nanos;
+    uint64_t _hits;
+    uint64_t _threads;
+    float    _self_pct;
+};
+
+extern "C" struct stperf_PerfHotspotList
+{
+    stperf_PerfHotspot* _elements;
+    uint64_t            _size;
+};
+
+extern "C" struct stperf_PerfLatency
+{
+    uint64_t _samples; // 0 when histograms were off
+    uint64_t _min_nanos;
+    uint64_t _max_nanos;
+    uint64_t _mean_nanos;
+    uint64_t _p50_nanos;
+    uint64_t _p99_nanos;
+    uint64_t _p999_nanos;
+};
+
+extern "C" struct stperf_PerfCounters
+{
+    uint64_t _cycles;
+    uint64_t _instructions;
+    uint64_t _cache_misses;
+    uint64_t _branch_misses;
+};
+
+extern "C" struct stperf_PerfCount
+{
+    char     _name[128];
+    uint64_t _value;
+    uint64_t _samples;
+    uint64_t _min;
+    uint64_t _max;
+    double   _rate;
+};
+
+extern "C" struct stperf_PerfCountList
+{
+    stperf_PerfCount* _elements;
+    uint64_t          _size;
+};
+
+// NUMA nodes kept in C nodes, higher ones are added to the last
+#define STPERF_NUMA_NODES 8
+
+extern "C" struct stperf_PerfPlacement
+{
+    uint64_t _hits[STPERF_NUMA_NODES]; // Entries per NUMA node they started on, zero when placement was off
+    uint64_t _nanos[STPERF_NUMA_NODES];
+};
+
+extern "C" struct stperf_ThreadInfo
+{
+    uint64_t _thread_id;
+    uint64_t _os_tid;
+    char     _name[128];
+    int      _alive;
+    uint32_t _last_cpu; // 0xFFFFFFFF until placement saw the thread
+    uint32_t _last_numa;
+    uint64_t _cpu_migrations;
+    uint64_t _numa_migrations;
+};
+
+extern "C" struct stperf_ThreadInfoList
+{
+    stperf_ThreadInfo* _elements;
+    uint64_t           _size;
+};
+
 extern "C" struct stperf_PerfNode
 {
     int      _granularity;
     float    _value;
     float    _pct;
     uint64_t _nanos;
+    uint64_t _overhead_nanos;
     char     _name[128]; // NOTE : Names will get cropped in C if more than 128 chars long
     int      _indent;
     uint64_t _hits;
+    uint64_t _raw_nanos;
+    uint64_t _raw_hits;
+    stperf_PerfLatency _latency;
+    uint64_t _threads;
+    uint64_t _min_thread_nanos;
+    uint64_t _max_thread_nanos;
+    float    _imbalance;
+    uint64_t _self_nanos;
+    float    _self_pct;
+    stperf_PerfCounters _counters;
+    uint64_t _cpu_nanos;
+    uint64_t _off_cpu_nanos;
+    uint64_t _suspended_nanos;
+    uint64_t _max_recursion;
+    stperf_PerfPlacement _placement;
+    stperf_PerfCountList _counts;
     stperf_PerfNodeList _children;
 };
 
+// Flat call tree, one block holding every thread, node and name
+//   thread nodes are contiguous and in preorder, links are indices in _nodes
+#define STPERF_FLAT_NONE 0xFFFFFFFFU
+
+extern "C" struct stperf_FlatNode
+{
+    uint64_t _nanos;
+    uint64_t _overhead_nanos;
+    uint64_t _hits;
+    uint64_t _raw_nanos;
+    uint64_t _raw_hits;
+    stperf_PerfLatency _latency;
+    uint64_t _threads;
+    uint64_t _min_thread_nanos;
+    uint64_t _max_thread_nanos;
+    uint64_t _self_nanos;
+    uint64_t _cpu_nanos;
+    uint64_t _off_cpu_nanos;
+    uint64_t _max_recursion;
+    float    _value;
+    float    _pct;
+    float    _imbalance;
+    float    _self_pct;
+    stperf_PerfCounters _counters;
+    stperf_PerfPlacement _placement;
+    int      _granularity;
+    int      _indent;
+    uint32_t _parent;       // STPERF_FLAT_NONE for thread roots
+    uint32_t _first_child;  // STPERF_FLAT_NONE for leaves
+    uint32_t _next_sibling; // Roots of the same thread are siblings too
+    uint32_t _name;         // Offset in _strings, full length and null terminated
+};
+
+extern "C" struct stperf_FlatThread
+{
+    uint64_t _thread_id;
+    uint32_t _first_node; // First root, STPERF_FLAT_NONE when the thread has none
+    uint32_t _node_count;
+};
+
+extern "C" struct stperf_FlatTree
+{
+    const stperf_FlatThread* _threads;
+    uint64_t                 _thread_count;
+    const stperf_FlatNode*   _nodes;
+    uint64_t                 _node_count;
+    const char*              _strings;
+    uint64_t                 _strings_size;
+    void*                    _block; // Everything above lives here
+};
+
+// Binary dump, native endianness, every section 8 byte aligned
+//   stperf_DumpHeader
+//   stperf_DumpThread[_thread_count]
+//   per thread stperf_DumpNode[_node_count], in preorder so parents come first
+//   string table of null terminated site names, referenced by byte offset
+#define STPERF_DUMP_VERSION   1
+#define STPERF_DUMP_ENDIAN    0x01020304U
+#define STPERF_DUMP_NO_PARENT 0xFFFFFFFFU
+
+extern "C" struct stperf_DumpHeader
+{
+    char     _magic[8]; // "STPERF" padded with zeros
+    uint32_t _version;
+    uint32_t _endian;
+    uint64_t _thread_count;
+    uint64_t _strings_offset;
+    uint64_t _strings_size;
+    uint64_t _file_size;
+};
+
+extern "C" struct stperf_DumpThread
+{
+    uint64_t _thread_id;
+    uint64_t _nodes_offset;
+    uint64_t _node_count;
+};
+
+extern "C" struct stperf_DumpNode
+{
+    uint64_t _nanos;
+    uint64_t _hits;
+    uint64_t _raw_nanos;
+    uint64_t _raw_hits;
+    uint64_t _overhead_nanos;
+    stperf_PerfLatency _latency;
+    uint32_t _parent; // Index in the same thread's node array
+    uint32_t _name;   // Offset in the string table
+    int32_t  _line;
+    uint32_t _depth;
+};
+
+// Read only view of a dump file, pointers go straight into the mapping
+extern "C" struct stperf_DumpView
+{
+    const stperf_DumpHeader* _header;
+    const stperf_DumpThread* _threads;
+    const char*              _strings;
+    const void*              _base;
+    uint64_t                 _size;
+};
+
+// Outputs of stperf_GetCallTreeDiff
+#define STPERF_DIFF_TEXT   0
+#define STPERF_DIFF_DOT    1
+#define STPERF_DIFF_FOLDED 2
+
+#define STPERF_SINK_CALLBACK 0
+#define STPERF_SINK_FILE     1
+#define STPERF_SINK_STATSD   2
+
+// The delta is only valid during the call, it is freed right after
+typedef void (*stperf_ReportCallback)(const stperf_PerfNodeThreadList* delta, void* user);
+
+extern "C" struct stperf_ReporterSink
+{
+    int                   _kind;
+    stperf_ReportCallback _callback; // STPERF_SINK_CALLBACK
+    void*                 _user;
+    const char*           _target;   // File path or statsd "host:port"
+};
+
+// Never returned by stperf_RegisterSite, entering it records nothing
+#define STPERF_NO_SITE 0U
+
 extern "C" uint64_t                  stperf_StartProf(const char* name, int line, const char* suffix);
 extern "C" void                      stperf_StopProf(uint64_t handle);
+extern "C" uint32_t                  stperf_RegisterSite(const char* name, int line, const char* suffix);
+extern "C" void                      stperf_Enter(uint32_t handle);
+extern "C" void                      stperf_Exit(uint32_t handle);
+extern "C" void                      stperf_SetSiteSampleRate(uint32_t handle, uint32_t rate);
+extern "C" void                      stperf_Count(uint32_t handle, uint64_t value);
 extern "C" void                      stperf_StopCounters();
 extern "C" stperf_PerfNodeThreadList stperf_GetCallTree();
 extern "C" const char*               stperf_GetCallTreeDot();
+extern "C" const char*               stperf_GetCallTreeFolded();
+extern "C" stperf_PerfHotspotList    stperf_GetTopSelfTime(uint64_t count);
+extern "C" void                      stperf_FreeTopSelfTime(stperf_PerfHotspotList list);
 extern "C" stperf_PerfNodeList*      stperf_GetThreadRoot(const stperf_PerfNodeThreadList* tree, uint64_t tid);
 extern "C" const char*               stperf_GetCallTreeString(stperf_PerfNodeThreadList tree);
 extern "C" void                      stperf_FreeCallTreeString(const char* string);
 extern "C" void                      stperf_FreeCallTree(stperf_PerfNodeThreadList tree);
+extern "C" stperf_FlatTree           stperf_GetFlatCallTree();
+extern "C" void                      stperf_FreeFlatCallTree(stperf_FlatTree tree);
 extern "C" void                      stperf_ResetCounters();
 extern "C" uint64_t                  stperf_GetCurrentThreadId();
+extern "C" void                      stperf_SetClockSource(int source);
+extern "C" int                       stperf_GetClockSource();
+extern "C" double                    stperf_GetScopeOverhead();
+extern "C" void                      stperf_SetOverheadCompensation(int enable);
+extern "C" void                      stperf_SetTraceEnabled(int enable);
+extern "C" void                      stperf_SetTraceBufferSize(uint64_t events);
+extern "C" stperf_PerfNodeThreadList stperf_GetTraceCallTree(double seconds);
+extern "C" const char*               stperf_GetChromeTrace(double seconds);
+extern "C" int                       stperf_WriteChromeTrace(const char* path, double seconds);
+extern "C" void                      stperf_SetSampleRate(const char* name, uint32_t rate);
+extern "C" void                      stperf_SetHistogramsEnabled(int enable);
+extern "C" int                       stperf_SetHardwareCountersEnabled(int enable);
+extern "C" int                       stperf_SetCpuTimeEnabled(int enable);
+extern "C" int                       stperf_SetPlacementEnabled(int enable);
+extern "C" void                      stperf_SetThreadName(const char* name);
+extern "C" stperf_ThreadInfoList     stperf_GetThreadInfo();
+extern "C" void                      stperf_FreeThreadInfo(stperf_ThreadInfoList list);
+extern "C" void                      stperf_SetTreeLimits(uint32_t max_depth, uint32_t max_nodes);
+extern "C" void                      stperf_SetRecursionCollapse(int enable);
+extern "C" stperf_PerfNodeList       stperf_GetMergedCallTree();
+extern "C" void                      stperf_FreeMergedCallTree(stperf_PerfNodeList tree);
+extern "C" stperf_Task*              stperf_CreateTask();
+extern "C" void                      stperf_DestroyTask(stperf_Task* task);
+extern "C" void                      stperf_TaskEnter(stperf_Task* task, uint32_t handle);
+extern "C" void                      stperf_TaskExit(stperf_Task* task);
+extern "C" void                      stperf_TaskSuspend(stperf_Task* task);
+extern "C" void                      stperf_TaskResume(stperf_Task* task);
+extern "C" stperf_PerfNodeList       stperf_GetTaskCallTree();
+extern "C" void                      stperf_FreeTaskCallTree(stperf_PerfNodeList tree);
+extern "C" int                       stperf_WriteCallTreeDump(const char* path);
+extern "C" int                       stperf_OpenDump(const char* path, stperf_DumpView* view);
+extern "C" const stperf_DumpNode*    stperf_GetDumpNodes(const stperf_DumpView* view, uint64_t thread);
+extern "C" void                      stperf_CloseDump(stperf_DumpView* view);
+extern "C" const char*               stperf_GetCallTreeDiff(const char* before_dump, const char* after_dump, int format);
+extern "C" int                       stperf_StartReporter(uint32_t interval_ms, stperf_ReporterSink sink);
+extern "C" void                      stperf_StopReporter();
 
 #define _ST_CAT_NAME(x,y) x##y
 #define ST_CAT_NAME(x,y) _ST_CAT_NAME(x,y)
-#define ST_PROF static auto ST_CAT_NAME(_perfcounter_,__LINE__) = cag::PerfTimer::MakePerfTimer(__func__, __LINE__, "()"); \
-                cag::ScopeGuard<std::shared_ptr<cag::PerfTimer>> ST_CAT_NAME(_scopeguard_,__LINE__)(ST_CAT_NAME(_perfcounter_,__LINE__))
 
-#define ST_PROF_NAMED(x) static auto ST_CAT_NAME(_perfcounter_,__LINE__) = cag::PerfTimer::MakePerfTimer(x, __LINE__); \
-                         cag::ScopeGuard<std::shared_ptr<cag::PerfTimer>> ST_CAT_NAME(_scopeguard_,__LINE__)(ST_CAT_NAME(_perfcounter_,__LINE__))
+// Define ST_PROF_DISABLED to compile every profiling macro out
+// Arguments go through an unevaluated sizeof, variables only profiled stay used but nothing runs
+#ifdef ST_PROF_DISABLED
+#define ST_PROF
+#define ST_PROF_NAMED(x) static_cast<void>(sizeof(x))
+#define ST_PROF_SAMPLED(x, n) static_cast<void>(sizeof(x)); static_cast<void>(sizeof(n))
+#define ST_PROF_TASK(task) static_cast<void>(sizeof(task))
+#define ST_PROF_TASK_NAMED(task, x) static_cast<void>(sizeof(task)); static_cast<void>(sizeof(x))
+#define ST_COUNT(x, value) do { static_cast<void>(sizeof(x)); static_cast<void>(sizeof(value)); } while(0)
+#else
+#define ST_PROF static const cag::PerfTimer ST_CAT_NAME(_perfcounter_,__LINE__)(__func__, __LINE__, "()"); \
+                cag::ScopeGuard<const cag::PerfTimer> ST_CAT_NAME(_scopeguard_,__LINE__)(ST_CAT_NAME(_perfcounter_,__LINE__))
+
+#define ST_PROF_NAMED(x) static const cag::PerfTimer ST_CAT_NAME(_perfcounter_,__LINE__)(x, __LINE__); \
+                         cag::ScopeGuard<const cag::PerfTimer> ST_CAT_NAME(_scopeguard_,__LINE__)(ST_CAT_NAME(_perfcounter_,__LINE__))
+
+// Records only about 1 in n entries, the reported hits and times are scaled back up
+#define ST_PROF_SAMPLED(x, n) static const cag::PerfTimer ST_CAT_NAME(_perfcounter_,__LINE__)(x, __LINE__, "", n); \
+                              cag::ScopeGuard<const cag::PerfTimer> ST_CAT_NAME(_scopeguard_,__LINE__)(ST_CAT_NAME(_perfcounter_,__LINE__))
+#define ST_PROF_TASK(task) static const cag::PerfTimer ST_CAT_NAME(_perfcounter_,__LINE__)(__func__, __LINE__, "()"); \
+                           cag::PerfTaskScope ST_CAT_NAME(_taskscope_,__LINE__)(task, ST_CAT_NAME(_perfcounter_,__LINE__))
+#define ST_PROF_TASK_NAMED(task, x) static const cag::PerfTimer ST_CAT_NAME(_perfcounter_,__LINE__)(x, __LINE__); \
+                                    cag::PerfTaskScope ST_CAT_NAME(_taskscope_,__LINE__)(task, ST_CAT_NAME(_perfcounter_,__LINE__))
+#define ST_COUNT(x, value) do { static const cag::PerfTimer _perfcount_(x, __LINE__); \
+                                cag::PerfTimer::Count(_perfcount_.id(), value); } while(0)
+#endif
@@ -6,7 +6,10 @@
 #include "catch2/matchers/catch_matchers.hpp"
 #include "catch2/matchers/catch_matchers_container_properties.hpp"
 #include "stperf.h"
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
 #include <cstdint>
 #include <fstream>
 #include <pthread.h>
@@ -205,6 +208,296 @@ TEST_CASE("As Function Argument", "[simple][auto]")
     REQUIRE(tree.at(std::this_thread::get_id()).at(1)._children.empty());
 }
 
+TEST_CASE("Aggregate Hot Loop", "[nested][auto]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    {
+        ST_PROF;
+        for(int i = 0; i < 100000; i++)
+        {
+            ST_PROF_NAMED("hot_loop");
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    REQUIRE(tree.at(std::this_thread::get_id()).size() == 1);
+    REQUIRE(tree.at(std::this_thread::get_id()).at(0)._children.size() == 1);
+    REQUIRE(tree.at(std::this_thread::get_id()).at(0)._children.at(0)._hits == 100000);
+    REQUIRE(tree.at(std::this_thread::get_id()).at(0)._children.at(0)._indent == 1);
+}
+
+TEST_CASE("Sampled Hot Loop", "[nested][auto][sampling]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    {
+        ST_PROF;
+        for(int i = 0; i < 100000; i++)
+        {
+            ST_PROF_SAMPLED("sampled_loop", 100);
+            ST_PROF_NAMED("sampled_inner");
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(root._hits == 1);
+    REQUIRE(root._raw_hits == 1);
+
+    // Roughly 1000 entries recorded, each one standing for 100
+    const auto& loop = root._children.at(0);
+    REQUIRE(cag::PerfTimer::GetSampleRate(loop._id) == 100);
+    REQUIRE(loop._raw_hits > 500);
+    REQUIRE(loop._raw_hits < 2000);
+    REQUIRE(loop._hits == loop._raw_hits * 100);
+    REQUIRE(loop._nanos >= loop._raw_nanos * 100);
+
+    // Nested scopes only run under a sampled parent and inherit its weight
+    const auto& inner = loop._children.at(0);
+    REQUIRE(inner._raw_hits == loop._raw_hits);
+    REQUIRE(inner._hits == loop._hits);
+    REQUIRE(inner._children.empty());
+}
+
+TEST_CASE("Latency Histograms", "[nested][auto][histogram]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetHistogramsEnabled(true);
+
+    {
+        ST_PROF;
+        for(int i = 0; i < 1000; i++)
+        {
+            ST_PROF_NAMED("histogram_loop");
+            if(i == 500) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    cag::PerfTimer::SetHistogramsEnabled(false);
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& loop = tree.at(std::this_thread::get_id()).at(0)._children.at(0);
+
+    // A single slow entry is the tail, it must not move the median
+    REQUIRE(loop._latency._samples == 1000);
+    REQUIRE(loop._latency._min_nanos <= loop._latency._p50_nanos);
+    REQUIRE(loop._latency._p50_nanos <= loop._latency._p99_nanos);
+    REQUIRE(loop._latency._p99_nanos <= loop._latency._p999_nanos);
+    REQUIRE(loop._latency._p999_nanos <= loop._latency._max_nanos);
+    REQUIRE(loop._latency._p50_nanos < 1000000);
+    REQUIRE(loop._latency._max_nanos >= 10000000);
+    REQUIRE(loop._latency._mean_nanos == loop._nanos / loop._hits);
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("p99.9") != std::string::npos);
+
+    // Bucket boundaries stay within the advertised precision
+    for(std::uint64_t v : { 1ULL, 15ULL, 16ULL, 1000ULL, 123456789ULL, 1ULL << 40 })
+    {
+        const std::uint64_t bucket = cag::PerfHistogram::BucketValue(cag::PerfHistogram::BucketIndex(v));
+        REQUIRE(bucket >= v - v / 16);
+        REQUIRE(bucket <= v + v / 16);
+    }
+}
+
+static void self_time_recurse(int depth)
+{
+    ST_PROF_NAMED("self_recurse");
+    std::this_thread::sleep_for(std::chrono::milliseconds(3));
+    if(depth > 0) self_time_recurse(depth - 1);
+}
+
+TEST_CASE("Self Time Hotspots", "[nested][recurse][auto]")
+{
+    cag::PerfTimer::ResetCounters();
+    {
+        ST_PROF_NAMED("self_root");
+        self_time_recurse(2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(4));
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    const auto& outer = root._children.at(0);
+    REQUIRE(root._self_nanos == root._nanos - outer._nanos);
+    REQUIRE(outer._self_nanos == outer._nanos - outer._children.at(0)._nanos);
+    REQUIRE(std::abs(root._self_pct - static_cast<double>(root._self_nanos) / root._nanos) < 1.0E-3);
+
+    // The sleep in the root outweighs each recursion level, but not all three together
+    auto top = cag::PerfTimer::GetTopSelfTime(tree, 1);
+    REQUIRE(top.size() == 1);
+    REQUIRE(cag::PerfTimer::GetSite(top.at(0)._id)._name == "self_recurse");
+    REQUIRE(top.at(0)._hits == 3);
+    REQUIRE(top.at(0)._nanos == outer._nanos);
+    REQUIRE(top.at(0)._self_nanos == outer._nanos);
+
+    auto all = cag::PerfTimer::GetTopSelfTime(tree, 10);
+    REQUIRE(all.size() == 2);
+    REQUIRE(std::abs(all.at(0)._self_pct + all.at(1)._self_pct - 1.0) < 1.0E-3);
+    REQUIRE(cag::PerfTimer::GetTopSelfTimeString(all).find("#2 [self_root | x1] Self time : ") != std::string::npos);
+}
+
+TEST_CASE("Interned Site Names", "[simple][manual]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    static auto perfc = cag::PerfTimer::MakePerfTimer("interned", __LINE__, "()");
+    static auto perfc_same_name = cag::PerfTimer::MakePerfTimer("interned", __LINE__, "()");
+
+    perfc->start();
+    perfc_same_name->start();
+    perfc_same_name->stop();
+    perfc->stop();
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(root.name() == "interned()");
+    REQUIRE(root._children.at(0).name() == "interned()");
+    REQUIRE(root._id != root._children.at(0)._id);
+    REQUIRE(cag::PerfTimer::GetSite(root._id)._line + 1 == cag::PerfTimer::GetSite(root._children.at(0)._id)._line);
+}
+
+TEST_CASE("Clock Sources", "[simple][auto][clock]")
+{
+    for(auto source : { cag::PerfClockSource::Chrono, cag::PerfClockSource::Hardware })
+    {
+        cag::PerfTimer::SetClockSource(source);
+        sleep_simple();
+
+        auto tree = cag::PerfTimer::GetCallTree();
+        REQUIRE(tree.at(std::this_thread::get_id()).at(0)._hits == 1);
+        REQUIRE(tree.at(std::this_thread::get_id()).at(0)._value > 10);
+        REQUIRE(tree.at(std::this_thread::get_id()).at(0)._value < 11);
+    }
+
+    cag::PerfTimer::SetClockSource(cag::PerfClockSource::Auto);
+    REQUIRE(cag::PerfTimer::GetClockSource() != cag::PerfClockSource::Auto);
+}
+
+TEST_CASE("Overhead Compensation", "[nested][auto][overhead]")
+{
+    cag::PerfTimer::ResetCounters();
+    REQUIRE(cag::PerfTimer::GetScopeOverhead() > 0.0);
+
+    {
+        ST_PROF;
+        for(int i = 0; i < 10000; i++)
+        {
+            ST_PROF_NAMED("overhead_loop");
+        }
+    }
+
+    auto raw = cag::PerfTimer::GetCallTree();
+    cag::PerfTimer::SetOverheadCompensation(true);
+    auto compensated = cag::PerfTimer::GetCallTree();
+    cag::PerfTimer::SetOverheadCompensation(false);
+
+    const auto& raw_root = raw.at(std::this_thread::get_id()).at(0);
+    const auto& compensated_root = compensated.at(std::this_thread::get_id()).at(0);
+    REQUIRE(raw_root._overhead_nanos > 0);
+    REQUIRE(raw_root._children.at(0)._overhead_nanos == 0);
+    REQUIRE(compensated_root._nanos == raw_root._nanos - std::min(raw_root._nanos, raw_root._overhead_nanos));
+    REQUIRE(compensated_root._children.at(0)._nanos == raw_root._children.at(0)._nanos);
+}
+
+TEST_CASE("Trace Ring Buffer", "[nested][auto][trace]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetTraceBufferSize(64);
+    cag::PerfTimer::SetTraceEnabled(true);
+
+    {
+        ST_PROF;
+        // Falls out of both the ring and the window we ask for below
+        sleep_simple();
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        // Overflows the ring, 31 full loop scopes survive plus the end of another
+        for(int i = 0; i < 100; i++)
+        {
+            ST_PROF_NAMED("traced_loop");
+        }
+    }
+
+    cag::PerfTimer::SetTraceEnabled(false);
+    auto tree = cag::PerfTimer::GetTraceCallTree(0.1);
+    auto full = cag::PerfTimer::GetCallTree();
+    cag::PerfTimer::SetTraceBufferSize(1 << 16);
+
+    // The enclosing scope began before the window but still shows up as the root
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(root._hits == 1);
+    REQUIRE(root._children.size() == 1);
+    REQUIRE(root._children.at(0).name() == "traced_loop");
+    REQUIRE(root._children.at(0)._hits == 32);
+    REQUIRE(root._nanos < full.at(std::this_thread::get_id()).at(0)._nanos);
+}
+
+TEST_CASE("Chrome Trace Export", "[nested][auto][trace]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetTraceEnabled(true);
+
+    {
+        ST_PROF_NAMED("chrome_\"outer\"");
+        for(int i = 0; i < 3; i++)
+        {
+            ST_PROF_NAMED("chrome_inner");
+        }
+
+        // Still running while exporting, closed at the export time
+        const std::string json = cag::PerfTimer::GetChromeTrace(1.0);
+        cag::PerfTimer::SetTraceEnabled(false);
+
+        auto count = [&json](const std::string& what) {
+            std::size_t n = 0;
+            for(std::size_t at = json.find(what); at != std::string::npos; at = json.find(what, at + 1)) n++;
+            return n;
+        };
+
+        REQUIRE(json.find("{\"traceEvents\":[") == 0);
+        REQUIRE(count("\"ph\":\"B\"") == 4);
+        REQUIRE(count("\"ph\":\"E\"") == 4);
+        REQUIRE(count("\"name\":\"chrome_inner\"") == 6);
+        REQUIRE(count("\"name\":\"chrome_\\\"outer\\\"\"") == 2);
+        REQUIRE(json.find("\"tid\":" + std::to_string(stperf_GetCurrentThreadId())) != std::string::npos);
+    }
+}
+
+TEST_CASE("Many Sibling Scopes", "[nested][manual]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    static std::vector<std::shared_ptr<cag::PerfTimer>> siblings;
+    static auto inner = cag::PerfTimer::MakePerfTimer("sibling_inner", __LINE__);
+    for(int i = static_cast<int>(siblings.size()); i < 5000; i++)
+    {
+        siblings.push_back(cag::PerfTimer::MakePerfTimer("sibling_" + std::to_string(i), __LINE__));
+    }
+
+    {
+        ST_PROF;
+        // Outer frames must survive the arena growing below them
+        for(const auto& sibling : siblings)
+        {
+            sibling->start();
+            inner->start();
+            inner->stop();
+            sibling->stop();
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(root._hits == 1);
+    REQUIRE(root._children.size() == 5000);
+    REQUIRE(root._children.front().name() == "sibling_4999");
+    for(const auto& child : root._children)
+    {
+        REQUIRE(child._hits == 1);
+        REQUIRE(child._children.size() == 1);
+        REQUIRE(child._children.at(0)._hits == 1);
+    }
+}
+
 // TODO : Missing body
 // TEST_CASE("As Function Argument Inside Recurse", "[nested][recurse][auto]")
 // {
@@ -269,6 +562,104 @@ TEST_CASE("C API Loop", "[capi][auto][simple]")
     stperf_FreeCallTree(nodes_all_threads);
 }
 
+TEST_CASE("C API Site Handles", "[capi][auto][mt]")
+{
+    stperf_ResetCounters();
+    const uint32_t outer = stperf_RegisterSite("C API Handles", __LINE__, NULL);
+    const uint32_t inner = stperf_RegisterSite("C API Handle", __LINE__, "_inner");
+    REQUIRE(outer != inner);
+
+    // The first site ever registered already got 1, 0 stays free as the no site value
+    REQUIRE(outer != STPERF_NO_SITE);
+    REQUIRE(inner != STPERF_NO_SITE);
+    REQUIRE(cag::PerfTimer::FindSite(STPERF_NO_SITE) == nullptr);
+    REQUIRE(cag::PerfTimer::FindSite(1) != nullptr);
+    REQUIRE_FALSE(cag::PerfTimer::Enter(STPERF_NO_SITE));
+
+    // Same name through the by name API resolves to one site, never a hash
+    uint64_t named = stperf_StartProf("C API Named", __LINE__, NULL);
+    stperf_StopProf(named);
+    REQUIRE(stperf_StartProf("C API Named", __LINE__, NULL) == named);
+    stperf_StopProf(named);
+
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 4; i++)
+    {
+        threads.emplace_back([outer, inner]() {
+            stperf_Enter(outer);
+            for(int j = 0; j < 1000; j++)
+            {
+                stperf_Enter(inner);
+                stperf_Exit(inner);
+            }
+            stperf_Exit(outer);
+        });
+    }
+    for(auto& t : threads) t.join();
+
+    // Unknown handles are ignored
+    stperf_Enter(0xFFFFFFF0U);
+    stperf_Exit(0xFFFFFFF0U);
+    stperf_StopProf(0xFFFFFFFFFFULL);
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    auto merged = cag::PerfTimer::GetMergedCallTree(tree);
+    const cag::PerfNode* region = nullptr;
+    for(const auto& node : merged) if(node.name() == "C API Handles") region = &node;
+    REQUIRE(region != nullptr);
+    REQUIRE(region->_threads == 4);
+    REQUIRE(region->_hits == 4);
+    REQUIRE(region->_children.size() == 1);
+    REQUIRE(region->_children.at(0).name() == "C API Handle_inner");
+    REQUIRE(region->_children.at(0)._hits == 4000);
+}
+
+TEST_CASE("C API Flat Tree", "[capi][auto][flat]")
+{
+    stperf_ResetCounters();
+    uint64_t handle = stperf_StartProf("C API Flat", __LINE__, NULL);
+    for(int i = 0; i < 3; i++)
+    {
+        uint64_t first = stperf_StartProf("Flat First", __LINE__, NULL);
+        stperf_StopProf(first);
+        uint64_t second = stperf_StartProf("Flat Second", __LINE__, NULL);
+        stperf_StopProf(second);
+    }
+    stperf_StopProf(handle);
+
+    stperf_FlatTree tree = stperf_GetFlatCallTree();
+    REQUIRE(tree._block != nullptr);
+
+    const stperf_FlatThread* thread = nullptr;
+    for(uint64_t i = 0; i < tree._thread_count; i++)
+    {
+        if(tree._threads[i]._thread_id == stperf_GetCurrentThreadId()) thread = &tree._threads[i];
+    }
+    REQUIRE(thread != nullptr);
+    REQUIRE(thread->_node_count == 3);
+
+    const stperf_FlatNode& root = tree._nodes[thread->_first_node];
+    REQUIRE_THAT(tree._strings + root._name, Catch::Matchers::Equals("C API Flat"));
+    REQUIRE(root._parent == STPERF_FLAT_NONE);
+    REQUIRE(root._next_sibling == STPERF_FLAT_NONE);
+    REQUIRE(root._hits == 1);
+
+    // Children are linked in order and point back at the root
+    std::vector<std::string> children;
+    for(uint32_t i = root._first_child; i != STPERF_FLAT_NONE; i = tree._nodes[i]._next_sibling)
+    {
+        REQUIRE(tree._nodes[i]._parent == thread->_first_node);
+        REQUIRE(tree._nodes[i]._first_child == STPERF_FLAT_NONE);
+        REQUIRE(tree._nodes[i]._hits == 3);
+        children.push_back(tree._strings + tree._nodes[i]._name);
+    }
+    REQUIRE(children.size() == 2);
+    REQUIRE(std::find(children.begin(), children.end(), "Flat First") != children.end());
+    REQUIRE(std::find(children.begin(), children.end(), "Flat Second") != children.end());
+
+    stperf_FreeFlatCallTree(tree);
+}
+
 TEST_CASE("Multi thread", "[auto][mt]")
 {
     cag::PerfTimer::ResetCounters();
@@ -293,6 +684,605 @@ TEST_CASE("Multi thread", "[auto][mt]")
     REQUIRE(nodes.at(tid).at(0)._children.size() == 1);
 }
 
+TEST_CASE("Many Threads Joining", "[auto][mt]")
+{
+    cag::PerfTimer::ResetCounters();
+    std::vector<std::thread> threads;
+    std::atomic<int> running(0);
+    for(int i = 0; i < 16; i++)
+    {
+        threads.emplace_back([&running](){
+            // Alive together so each one reports under its own id, see the sequential case below
+            running++;
+            while(running.load() < 16) std::this_thread::yield();
+            for(int j = 0; j < 1000; j++)
+            {
+                ST_PROF_NAMED("worker");
+            }
+        });
+    }
+    for(auto& t : threads) t.join();
+
+    auto nodes = cag::PerfTimer::GetCallTree();
+    REQUIRE(nodes.size() == 16);
+    for(const auto& thread_root : nodes)
+    {
+        REQUIRE(thread_root.second.size() == 1);
+        REQUIRE(thread_root.second.at(0)._hits == 1000);
+    }
+
+    // Finished threads are dropped on reset
+    cag::PerfTimer::ResetCounters();
+    REQUIRE(cag::PerfTimer::GetCallTree().empty());
+}
+
+TEST_CASE("Sequential Threads Joining", "[auto][mt][trace]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetTraceEnabled(true);
+
+    // Each thread exits before the next starts, they usually get the same std::thread::id
+    for(int i = 0; i < 4; i++)
+    {
+        std::thread t([](){
+            ST_PROF_NAMED("sequential_worker");
+        });
+        t.join();
+    }
+    cag::PerfTimer::SetTraceEnabled(false);
+
+    auto hits = [](const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& tree) {
+        uint64_t total = 0;
+        for(const auto& thread_root : tree)
+        {
+            for(const auto& node : thread_root.second)
+            {
+                if(node.name() != "sequential_worker") continue;
+                REQUIRE(node._threads == 1);
+                total += node._hits;
+            }
+        }
+        return total;
+    };
+    REQUIRE(hits(cag::PerfTimer::GetCallTree()) == 4);
+    REQUIRE(hits(cag::PerfTimer::GetTraceCallTree(10.0)) == 4);
+}
+
+TEST_CASE("Hardware Counters", "[nested][auto][counters]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    // Virtual machines and locked down kernels have no PMU, nothing must be recorded then
+    const bool available = cag::PerfTimer::SetHardwareCountersEnabled(true);
+    volatile std::uint64_t sum = 0;
+    {
+        ST_PROF_NAMED("counted_loop");
+        for(std::uint64_t i = 0; i < 1000000; i++) sum = sum + i;
+    }
+    cag::PerfTimer::SetHardwareCountersEnabled(false);
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& loop = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(loop.name() == "counted_loop");
+    if(available)
+    {
+        REQUIRE(loop._counters._cycles > 0);
+        REQUIRE(loop._counters._instructions > 1000000);
+        REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("IPC") != std::string::npos);
+    }
+    else
+    {
+        REQUIRE(loop._counters._cycles == 0);
+        REQUIRE(loop._counters._instructions == 0);
+        REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("IPC") == std::string::npos);
+    }
+}
+
+TEST_CASE("CPU Time", "[nested][auto][cputime]")
+{
+    cag::PerfTimer::ResetCounters();
+    REQUIRE(cag::PerfTimer::SetCpuTimeEnabled(true));
+    {
+        ST_PROF_NAMED("cpu_blocked");
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    {
+        ST_PROF_NAMED("cpu_busy");
+        const auto start = std::chrono::steady_clock::now();
+        while(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(20));
+    }
+    cag::PerfTimer::SetCpuTimeEnabled(false);
+    {
+        ST_PROF_NAMED("cpu_off");
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& roots = tree.at(std::this_thread::get_id());
+    REQUIRE(roots.size() == 3);
+    for(const auto& node : roots)
+    {
+        if(node.name() == "cpu_blocked")
+        {
+            // Sleeping is all off CPU time
+            REQUIRE(node._off_cpu_nanos >= 15000000);
+            REQUIRE(node._cpu_nanos < node._off_cpu_nanos);
+        }
+        else if(node.name() == "cpu_busy")
+        {
+            REQUIRE(node._cpu_nanos > node._nanos / 2);
+            REQUIRE(node._cpu_nanos + node._off_cpu_nanos == node._nanos);
+        }
+        else
+        {
+            REQUIRE(node._cpu_nanos == 0);
+            REQUIRE(node._off_cpu_nanos == 0);
+        }
+    }
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("Off CPU") != std::string::npos);
+}
+
+TEST_CASE("Thread Names and Placement", "[mt][auto][capi][placement]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetThreadName("stperf main");
+    const bool placement = cag::PerfTimer::SetPlacementEnabled(true);
+    for(int i = 0; i < 10; i++)
+    {
+        ST_PROF_NAMED("placed_outer");
+        ST_PROF_NAMED("placed_inner");
+    }
+
+    // Ids are handed out while other threads register and report
+    std::vector<std::thread> workers;
+    std::vector<uint64_t> ids(8);
+    std::atomic<int> running(0);
+    for(int t = 0; t < 8; t++)
+    {
+        workers.emplace_back([t, &ids, &running]() {
+            stperf_SetThreadName(("stperf worker " + std::to_string(t)).c_str());
+            {
+                ST_PROF_NAMED("placed_worker");
+            }
+            ids[t] = stperf_GetCurrentThreadId();
+            (void)cag::PerfTimer::GetThreadInfo();
+
+            // Alive together so no worker hands its std::thread::id to the next
+            running++;
+            while(running.load() < 8) std::this_thread::yield();
+        });
+    }
+    for(auto& worker : workers) worker.join();
+    cag::PerfTimer::SetPlacementEnabled(false);
+
+    std::vector<uint64_t> unique_ids(ids);
+    std::sort(unique_ids.begin(), unique_ids.end());
+    REQUIRE(std::unique(unique_ids.begin(), unique_ids.end()) == unique_ids.end());
+    REQUIRE(std::find(ids.begin(), ids.end(), stperf_GetCurrentThreadId()) == ids.end());
+
+    const auto threads = cag::PerfTimer::GetThreadInfo();
+    const auto& main_info = threads.at(std::this_thread::get_id());
+    REQUIRE(main_info._name == "stperf main");
+    REQUIRE(main_info._thread_id == stperf_GetCurrentThreadId());
+    REQUIRE(main_info._alive);
+    REQUIRE(threads.size() == 9);
+
+    const auto tree = cag::PerfTimer::GetCallTree();
+    const std::string text = cag::PerfTimer::GetCallTreeString(tree);
+    REQUIRE(text.find("[Thread - " + std::to_string(main_info._thread_id) + " | stperf main") != std::string::npos);
+    REQUIRE(text.find(" | stperf worker 3") != std::string::npos);
+
+    stperf_ThreadInfoList list = stperf_GetThreadInfo();
+    REQUIRE(list._size == threads.size());
+    int named_workers = 0;
+    for(uint64_t i = 0; i < list._size; i++)
+    {
+        if(std::string(list._elements[i]._name).find("stperf worker") == 0)
+        {
+            named_workers++;
+            REQUIRE(list._elements[i]._alive == 0);
+        }
+    }
+    REQUIRE(named_workers == 8);
+    stperf_FreeThreadInfo(list);
+
+    if(!placement) return;
+
+    // Every recorded entry lands on exactly one NUMA node
+    const auto& outer = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(outer.name() == "placed_outer");
+    REQUIRE_FALSE(outer._numa_hits.empty());
+    uint64_t hits = 0;
+    for(const auto h : outer._numa_hits) hits += h;
+    REQUIRE(hits == 10);
+    REQUIRE(outer._children.at(0)._numa_hits.size() == outer._numa_hits.size());
+    REQUIRE(main_info._last_cpu != UINT32_MAX);
+    REQUIRE(main_info._last_numa < outer._numa_hits.size());
+    REQUIRE(text.find(" NUMA : node ") != std::string::npos);
+}
+
+TEST_CASE("Task Scopes", "[mt][auto][task]")
+{
+    cag::PerfTimer::ResetCounters();
+    const std::uint32_t request = cag::PerfTimer::RegisterSite("task_request", __LINE__);
+
+    // Starts on one worker, suspends, then resumes and finishes on another
+    cag::PerfTask task;
+    std::thread first([&task, request]() {
+        task.enter(request);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        task.suspend();
+    });
+    first.join();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread second([&task]() {
+        task.resume();
+        {
+            ST_PROF_TASK_NAMED(task, "task_step");
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        task.exit();
+    });
+    second.join();
+
+    // Unbalanced unknown sites do not break the stack
+    task.enter(0xFFFFFFF0U);
+    task.exit();
+
+    auto tasks = cag::PerfTimer::GetTaskCallTree();
+    REQUIRE(tasks.size() == 1);
+    const auto& root = tasks.at(0);
+    REQUIRE(root.name() == "task_request");
+    REQUIRE(root._hits == 1);
+    REQUIRE(root._nanos >= 30000000);
+    REQUIRE(root._suspended_nanos >= 15000000);
+    REQUIRE(root._suspended_nanos < root._nanos);
+    REQUIRE(root._children.size() == 1);
+    REQUIRE(root._children.at(0).name() == "task_step");
+    REQUIRE(root._children.at(0)._suspended_nanos == 0);
+    REQUIRE(cag::PerfTimer::GetTaskCallTreeString(tasks).find("Suspended") != std::string::npos);
+
+    // Task scopes stay out of the thread trees
+    for(const auto& thread_root : cag::PerfTimer::GetCallTree()) REQUIRE(thread_root.second.empty());
+
+    // Same through the C API
+    stperf_Task* ctask = stperf_CreateTask();
+    stperf_TaskEnter(ctask, stperf_RegisterSite("task_c", __LINE__, NULL));
+    stperf_TaskSuspend(ctask);
+    stperf_TaskResume(ctask);
+    stperf_TaskExit(ctask);
+    stperf_DestroyTask(ctask);
+    stperf_PerfNodeList ctasks = stperf_GetTaskCallTree();
+    REQUIRE(ctasks._size == 2);
+    stperf_FreeTaskCallTree(ctasks);
+}
+
+TEST_CASE("Scope Counts", "[mt][auto][count]")
+{
+    cag::PerfTimer::ResetCounters();
+    auto stage = []() {
+        ST_PROF_NAMED("count_stage");
+        for(int i = 1; i <= 10; i++)
+        {
+            ST_COUNT("bytes", 100 * i);
+            ST_COUNT("items", 1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    };
+    stage();
+    std::thread worker(stage);
+    worker.join();
+    ST_COUNT("bytes", 1); // Outside any scope, dropped
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& node = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(node._counts.size() == 2);
+    REQUIRE(node._counts.at(0).name() == "bytes");
+    REQUIRE(node._counts.at(0)._value == 5500);
+    REQUIRE(node._counts.at(0)._samples == 10);
+    REQUIRE(node._counts.at(0)._min == 100);
+    REQUIRE(node._counts.at(0)._max == 1000);
+    REQUIRE(node._counts.at(0)._rate > 0.0);
+    REQUIRE(node._counts.at(0)._rate < 5500.0 * 1.0E9 / 5000000.0);
+    REQUIRE(node._counts.at(1).name() == "items");
+    REQUIRE(node._counts.at(1)._value == 10);
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("(bytes : 5500") != std::string::npos);
+
+    auto merged = cag::PerfTimer::GetMergedCallTree(tree);
+    REQUIRE(merged.size() == 1);
+    REQUIRE(merged.at(0)._counts.at(0)._value == 11000);
+    REQUIRE(merged.at(0)._counts.at(1)._value == 20);
+
+    stperf_PerfNodeList cmerged = stperf_GetMergedCallTree();
+    REQUIRE(cmerged._size == 1);
+    REQUIRE(cmerged._elements[0]->_counts._size == 2);
+    REQUIRE_THAT(cmerged._elements[0]->_counts._elements[0]._name, Catch::Matchers::Equals("bytes"));
+    REQUIRE(cmerged._elements[0]->_counts._elements[0]._value == 11000);
+    stperf_FreeMergedCallTree(cmerged);
+}
+
+static void recurse_limits(int depth)
+{
+    ST_PROF_NAMED("limits_recurse");
+    if(depth > 1) recurse_limits(depth - 1);
+}
+
+TEST_CASE("Tree Limits", "[nested][recurse][auto][limits]")
+{
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetTreeLimits(3, 0);
+    recurse_limits(10);
+    recurse_limits(10);
+
+    // The 7 entries past depth 3 end up in one overflow node, timed once per outer entry
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& third = tree.at(std::this_thread::get_id()).at(0)._children.at(0)._children.at(0);
+    REQUIRE(third.name() == "limits_recurse");
+    REQUIRE(third._children.size() == 1);
+    const auto& overflow = third._children.at(0);
+    REQUIRE(overflow.name() == "[overflow]");
+    REQUIRE(overflow._hits == 14);
+    REQUIRE(overflow._children.empty());
+    REQUIRE(overflow._nanos <= third._nanos);
+
+    // Dynamic names past the node budget, one overflow bucket per parent
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetTreeLimits(0, 4);
+    for(int i = 0; i < 10; i++)
+    {
+        const uint32_t site = stperf_RegisterSite(("limits_dynamic_" + std::to_string(i)).c_str(), __LINE__, NULL);
+        stperf_Enter(site);
+        stperf_Exit(site);
+    }
+    tree = cag::PerfTimer::GetCallTree();
+    const auto& roots = tree.at(std::this_thread::get_id());
+    REQUIRE(roots.size() == 5);
+    std::uint64_t overflow_hits = 0;
+    for(const auto& root : roots) if(root.name() == "[overflow]") overflow_hits = root._hits;
+    REQUIRE(overflow_hits == 6);
+    cag::PerfTimer::SetTreeLimits(0, 0);
+
+    // Direct self recursion folds into a single node with its depths
+    cag::PerfTimer::ResetCounters();
+    cag::PerfTimer::SetRecursionCollapse(true);
+    recurse_limits(1);
+    recurse_limits(11);
+    recurse_limits(3);
+    cag::PerfTimer::SetRecursionCollapse(false);
+
+    tree = cag::PerfTimer::GetCallTree();
+    const auto& collapsed = tree.at(std::this_thread::get_id()).at(0);
+    REQUIRE(collapsed._children.empty());
+    REQUIRE(collapsed._hits == 15);
+    REQUIRE(collapsed._max_recursion == 11);
+    REQUIRE(collapsed._recursion.size() == 4);
+    REQUIRE(collapsed._recursion.at(0) == 1);
+    REQUIRE(collapsed._recursion.at(1) == 1);
+    REQUIRE(collapsed._recursion.at(2) == 0);
+    REQUIRE(collapsed._recursion.at(3) == 1);
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree).find("Recursion : max depth 11.") != std::string::npos);
+}
+
+TEST_CASE("Parallel Snapshot", "[manual][mt][snapshot]")
+{
+    cag::PerfTimer::ResetCounters();
+
+    // Enough nodes overall for the per thread conversion to be spread over workers
+    static std::vector<std::shared_ptr<cag::PerfTimer>> sites;
+    for(int i = static_cast<int>(sites.size()); i < 1000; i++)
+    {
+        sites.push_back(cag::PerfTimer::MakePerfTimer("parallel_" + std::to_string(i), __LINE__));
+    }
+
+    std::vector<std::thread> threads;
+    std::atomic<int> running(0);
+    for(int i = 0; i < 8; i++)
+    {
+        threads.emplace_back([&running](){
+            running++;
+            while(running.load() < 8) std::this_thread::yield();
+            ST_PROF_NAMED("parallel_root");
+            for(const auto& site : sites)
+            {
+                site->start();
+                site->stop();
+            }
+        });
+    }
+    for(auto& t : threads) t.join();
+
+    auto nodes = cag::PerfTimer::GetCallTree();
+    REQUIRE(nodes.size() == 8);
+    for(const auto& thread_root : nodes)
+    {
+        const auto& root = thread_root.second.at(0);
+        REQUIRE(root._hits == 1);
+        REQUIRE(root._children.size() == 1000);
+        REQUIRE(root._children.front().name() == "parallel_999");
+        REQUIRE(root._children.back().name() == "parallel_0");
+    }
+}
+
+TEST_CASE("Merged Threads", "[auto][mt][merge]")
+{
+    cag::PerfTimer::ResetCounters();
+    std::vector<std::thread> threads;
+    std::atomic<int> running(0);
+    for(int i = 0; i < 4; i++)
+    {
+        threads.emplace_back([&running, i](){
+            running++;
+            while(running.load() < 4) std::this_thread::yield();
+            ST_PROF_NAMED("merge_region");
+            for(int j = 0; j <= i; j++)
+            {
+                ST_PROF_NAMED("merge_work");
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            }
+            if(i == 0)
+            {
+                ST_PROF_NAMED("merge_only_first");
+            }
+        });
+    }
+    for(auto& t : threads) t.join();
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    auto merged = cag::PerfTimer::GetMergedCallTree(tree);
+    REQUIRE(merged.size() == 1);
+
+    const auto& region = merged.at(0);
+    REQUIRE(region.name() == "merge_region");
+    REQUIRE(region._threads == 4);
+    REQUIRE(region._hits == 4);
+    REQUIRE(region._children.size() == 2);
+
+    // Thread i did i + 1 units of work, the slowest sits well above the mean
+    std::uint64_t total = 0;
+    for(const auto& thread_root : tree) total += thread_root.second.at(0)._nanos;
+    REQUIRE(region._nanos == total);
+    REQUIRE(region._min_thread_nanos < region._max_thread_nanos);
+    REQUIRE(region._imbalance > 0.3f);
+
+    for(const auto& child : region._children)
+    {
+        if(child.name() == "merge_work")
+        {
+            REQUIRE(child._threads == 4);
+            REQUIRE(child._hits == 10);
+        }
+        else
+        {
+            REQUIRE(child.name() == "merge_only_first");
+            REQUIRE(child._threads == 1);
+            REQUIRE(child._imbalance == 0.0f);
+        }
+    }
+    REQUIRE(cag::PerfTimer::GetMergedCallTreeString(merged).find("4 threads") != std::string::npos);
+}
+
+TEST_CASE("Periodic Reporter", "[auto][mt][reporter]")
+{
+    cag::PerfTimer::ResetCounters();
+    std::mutex guard;
+    std::vector<std::uint64_t> hits;
+
+    REQUIRE(cag::PerfTimer::StartReporter(std::chrono::milliseconds(10), [&](const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>& delta) {
+        // Only this test's thread records while the reporter runs
+        std::uint64_t interval_hits = 0;
+        for(const auto& thread_root : delta)
+        {
+            for(const auto& root : thread_root.second)
+            {
+                for(const auto& child : root._children) interval_hits += child._hits;
+            }
+        }
+        std::lock_guard<std::mutex> lock(guard);
+        hits.push_back(interval_hits);
+    }));
+    REQUIRE_FALSE(cag::PerfTimer::StartReporter(std::chrono::milliseconds(10), [](const std::unordered_map<std::thread::id, std::vector<cag::PerfNode>>&) {}));
+
+    {
+        // Never finishes while reporting, its children still come through
+        ST_PROF_NAMED("reporter_region");
+        for(int i = 0; i < 50; i++)
+        {
+            ST_PROF_NAMED("reporter_step");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        cag::PerfTimer::StopReporter();
+    }
+
+    // Intervals add up to the totals, nothing was reset
+    std::uint64_t total = 0;
+    for(const auto h : hits) total += h;
+    REQUIRE(hits.size() > 1);
+    REQUIRE(total == 50);
+    REQUIRE(cag::PerfTimer::GetCallTree().at(std::this_thread::get_id()).at(0)._children.at(0)._hits == 50);
+}
+
+TEST_CASE("Live Snapshot", "[auto][mt][snapshot]")
+{
+    cag::PerfTimer::ResetCounters();
+    std::atomic<bool> done(false);
+    std::atomic<bool> started(false);
+    std::thread::id tid;
+
+    std::thread worker([&](){
+        tid = std::this_thread::get_id();
+        int i = 0;
+        while(!done.load())
+        {
+            ST_PROF_NAMED("live_outer");
+            {
+                // New sibling paths keep appearing while we snapshot
+                static std::vector<std::shared_ptr<cag::PerfTimer>> timers;
+                if(timers.size() < 64) timers.push_back(cag::PerfTimer::MakePerfTimer("live_inner", __LINE__));
+                timers[i++ % timers.size()]->start();
+                timers[(i - 1) % timers.size()]->stop();
+            }
+            started.store(true);
+        }
+    });
+
+    while(!started.load()) std::this_thread::yield();
+
+    std::uint64_t last_hits = 0;
+    for(int n = 0; n < 100; n++)
+    {
+        auto tree = cag::PerfTimer::GetCallTree();
+        auto it = tree.find(tid);
+        if(it == tree.end()) continue;
+        REQUIRE(it->second.at(0)._hits >= last_hits);
+        last_hits = it->second.at(0)._hits;
+    }
+
+    done.store(true);
+    worker.join();
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    REQUIRE(tree.at(tid).at(0)._children.size() == 64);
+}
+
+TEST_CASE("Snapshot While Registering", "[auto][mt][snapshot]")
+{
+    cag::PerfTimer::ResetCounters();
+    std::atomic<bool> done(false);
+
+    // Snapshots only hold the context list while copying it, new threads keep registering
+    std::thread reader([&done](){
+        while(!done.load())
+        {
+            (void)cag::PerfTimer::GetCallTree();
+            (void)cag::PerfTimer::GetThreadInfo();
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for(int i = 0; i < 32; i++)
+    {
+        workers.emplace_back([](){
+            for(int j = 0; j < 100; j++)
+            {
+                ST_PROF_NAMED("registering_worker");
+            }
+        });
+        if(i % 4 == 3)
+        {
+            for(auto& worker : workers) worker.join();
+            workers.clear();
+        }
+    }
+    done.store(true);
+    reader.join();
+
+    std::uint64_t hits = 0;
+    for(const auto& root : cag::PerfTimer::GetMergedCallTree())
+    {
+        if(root.name() == "registering_worker") hits += root._hits;
+    }
+    REQUIRE(hits == 3200);
+}
+
 static void* cthread(void* args)
 {
     (void)args;
@@ -353,6 +1343,206 @@ TEST_CASE("OpenMP Test", "[auto][mt][omp]")
     REQUIRE(tree.size() == 10); // OpenMP also uses the calling thread as a worker
 }
 
+TEST_CASE("OpenMP Shared Timer", "[auto][mt][omp]")
+{
+    cag::PerfTimer::ResetCounters();
+    #pragma omp parallel for num_threads(4)
+    for(int i = 0; i < 40; i++)
+    {
+        ST_PROF_NAMED("OMP Sleep");
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+
+    std::uint64_t hits = 0;
+    for(const auto& thread_root : tree)
+    {
+        const auto& node = thread_root.second.at(0);
+        hits += node._hits;
+
+        // Each thread keeps its own start time, so no iteration is over or under counted
+        REQUIRE(node._nanos / node._hits >= 2000000);
+        REQUIRE(node._nanos / node._hits < 4000000);
+    }
+    REQUIRE(hits == 40);
+}
+
+TEST_CASE("Binary Dump", "[auto][capi][dump]")
+{
+    cag::PerfTimer::ResetCounters();
+    {
+        ST_PROF_NAMED("dump_root");
+        for(int i = 0; i < 10; i++)
+        {
+            ST_PROF_NAMED("dump_child");
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    REQUIRE(cag::PerfTimer::WriteCallTreeDump("stperf_test.dump", tree));
+
+    stperf_DumpView view;
+    REQUIRE(stperf_OpenDump("stperf_test.dump", &view) == 0);
+    REQUIRE(view._header->_version == STPERF_DUMP_VERSION);
+    REQUIRE(view._header->_thread_count == 1);
+    REQUIRE(view._threads[0]._thread_id == stperf_GetCurrentThreadId());
+    REQUIRE(view._threads[0]._node_count == 2);
+
+    // Preorder, the child points back at its root
+    const stperf_DumpNode* nodes = stperf_GetDumpNodes(&view, 0);
+    REQUIRE(nodes[0]._parent == STPERF_DUMP_NO_PARENT);
+    REQUIRE(std::string(view._strings + nodes[0]._name) == "dump_root");
+    REQUIRE(nodes[0]._hits == 1);
+    REQUIRE(nodes[0]._nanos == tree.at(std::this_thread::get_id()).at(0)._nanos);
+    REQUIRE(nodes[1]._parent == 0);
+    REQUIRE(nodes[1]._depth == 1);
+    REQUIRE(std::string(view._strings + nodes[1]._name) == "dump_child");
+    REQUIRE(nodes[1]._hits == 10);
+    REQUIRE(stperf_GetDumpNodes(&view, 1) == nullptr);
+    stperf_CloseDump(&view);
+
+    REQUIRE(stperf_OpenDump("missing.dump", &view) != 0);
+}
+
+static void diff_stage(int slow_ms, bool replaced)
+{
+    ST_PROF_NAMED("diff_root");
+    {
+        ST_PROF_NAMED("diff_slower");
+        std::this_thread::sleep_for(std::chrono::milliseconds(slow_ms));
+    }
+    if(replaced)
+    {
+        ST_PROF_NAMED("diff_added");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    else
+    {
+        ST_PROF_NAMED("diff_removed");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+TEST_CASE("Call Tree Diff", "[auto][capi][dump][diff]")
+{
+    cag::PerfTimer::ResetCounters();
+    diff_stage(1, false);
+    const auto before = cag::PerfTimer::GetCallTree();
+    REQUIRE(cag::PerfTimer::WriteCallTreeDump("stperf_before.dump", before));
+
+    cag::PerfTimer::ResetCounters();
+    diff_stage(10, true);
+    diff_stage(10, true);
+    const auto after = cag::PerfTimer::GetCallTree();
+    REQUIRE(cag::PerfTimer::WriteCallTreeDump("stperf_after.dump", after));
+
+    const auto diff = cag::PerfTimer::GetCallTreeDiff(before, after);
+    REQUIRE(diff.size() == 1);
+    REQUIRE(diff.at(0)._name == "diff_root");
+    REQUIRE(diff.at(0)._delta_hits == 1);
+    REQUIRE(diff.at(0)._change > 1.0);
+
+    // Biggest regression first, a path gone from after sorts last at -100%
+    const auto& children = diff.at(0)._children;
+    REQUIRE(children.size() == 3);
+    REQUIRE(children.at(0)._name == "diff_slower");
+    REQUIRE(children.at(0)._delta_nanos > 0);
+    REQUIRE(children.at(0)._before_hits == 1);
+    REQUIRE(children.at(0)._after_hits == 2);
+    REQUIRE(children.at(1)._name == "diff_added");
+    REQUIRE(children.at(1)._before_nanos == 0);
+    REQUIRE(std::isinf(children.at(1)._change));
+    REQUIRE(children.at(2)._name == "diff_removed");
+    REQUIRE(children.at(2)._after_nanos == 0);
+    REQUIRE(children.at(2)._change == -1.0);
+    REQUIRE(children.at(2)._delta_hits == -1);
+
+    // Dumps carry the same names and times
+    std::vector<cag::PerfDiffNode> dump_diff;
+    REQUIRE(cag::PerfTimer::GetCallTreeDiff("stperf_before.dump", "stperf_after.dump", dump_diff));
+    REQUIRE(dump_diff.size() == 1);
+    REQUIRE(dump_diff.at(0)._delta_nanos == diff.at(0)._delta_nanos);
+    REQUIRE(dump_diff.at(0)._children.at(2)._name == "diff_removed");
+    REQUIRE_FALSE(cag::PerfTimer::GetCallTreeDiff("stperf_before.dump", "missing.dump", dump_diff));
+
+    const std::string text = cag::PerfTimer::GetCallTreeDiffString(diff);
+    REQUIRE(text.find("-> [diff_added] Time : 0ns -> ") != std::string::npos);
+    REQUIRE(text.find("new). Hits : 0 -> 2 (+2).") != std::string::npos);
+    REQUIRE(cag::PerfTimer::GetCallTreeDiffDot(diff).find("fillcolor=\"#ff") != std::string::npos);
+    REQUIRE(cag::PerfTimer::GetCallTreeDiffFolded(diff).find("diff_root;diff_removed " + std::to_string(children.at(2)._before_nanos) + " 0\n") != std::string::npos);
+
+    const char* folded = stperf_GetCallTreeDiff("stperf_before.dump", "stperf_after.dump", STPERF_DIFF_FOLDED);
+    REQUIRE(folded != nullptr);
+    REQUIRE(std::string(folded).find("diff_root;diff_added 0 ") != std::string::npos);
+    stperf_FreeCallTreeString(folded);
+    REQUIRE(stperf_GetCallTreeDiff("missing.dump", "stperf_after.dump", STPERF_DIFF_TEXT) == nullptr);
+}
+
+TEST_CASE("Folded Stacks", "[nested][auto][folded]")
+{
+    cag::PerfTimer::ResetCounters();
+    {
+        ST_PROF_NAMED("folded;root");
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        {
+            ST_PROF_NAMED("folded child");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const auto& root = tree.at(std::this_thread::get_id()).at(0);
+    const std::string thread_frame = "Thread - " + std::to_string(stperf_GetCurrentThreadId());
+    const std::string expected =
+        thread_frame + ";folded_root " + std::to_string(root._nanos - root._children.at(0)._nanos) + "\n" +
+        thread_frame + ";folded_root;folded child " + std::to_string(root._children.at(0)._nanos) + "\n";
+    REQUIRE(cag::PerfTimer::GetCallTreeFolded(tree) == expected);
+
+    const char* folded = stperf_GetCallTreeFolded();
+    REQUIRE(std::string(folded).find(";folded_root;folded child ") != std::string::npos);
+    stperf_FreeCallTreeString(folded);
+}
+
+TEST_CASE("Cached Reports", "[nested][auto][report]")
+{
+    cag::PerfTimer::ResetCounters();
+    {
+        ST_PROF_NAMED("cached root");
+        for(int i = 0; i < 3; i++)
+        {
+            ST_PROF_NAMED("cached child");
+        }
+    }
+
+    auto tree = cag::PerfTimer::GetCallTree();
+    const std::string text = cag::PerfTimer::GetCallTreeString(tree);
+    const std::string dot = cag::PerfTimer::GetCallTreeDot(tree);
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree) == text);
+    REQUIRE(cag::PerfTimer::GetCallTreeDot(tree) == dot);
+
+    // Only the changed node is formatted again, the output must still be whole
+    auto& child = tree.at(std::this_thread::get_id()).at(0)._children.at(0);
+    child._hits = child._raw_hits = 12345;
+    const std::string changed = cag::PerfTimer::GetCallTreeString(tree);
+    REQUIRE(changed.find("[cached child | x12345") != std::string::npos);
+    REQUIRE(changed.find("[cached root | x1]") != std::string::npos);
+    REQUIRE(changed.size() == text.size() + 4);
+    REQUIRE(cag::PerfTimer::GetCallTreeDot(tree).find("{12345 hits") != std::string::npos);
+
+    child._hits = child._raw_hits = 3;
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree) == text);
+    REQUIRE(cag::PerfTimer::GetCallTreeDot(tree) == dot);
+
+    // Nodes coming and going shift the lines after them
+    auto pruned = tree;
+    pruned.at(std::this_thread::get_id()).at(0)._children.clear();
+    REQUIRE(cag::PerfTimer::GetCallTreeString(pruned).find("cached child") == std::string::npos);
+    REQUIRE(cag::PerfTimer::GetCallTreeString(tree) == text);
+    REQUIRE(cag::PerfTimer::GetCallTreeDot(pruned).find("cached child") == std::string::npos);
+    REQUIRE(cag::PerfTimer::GetCallTreeDot(tree) == dot);
+}
+
 TEST_CASE("Dotfile output", "[auto][dot]")
 {
     cag::PerfTimer::ResetCounters();